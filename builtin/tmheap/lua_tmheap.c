@@ -0,0 +1,263 @@
+#include <stdint.h>
+#include <string.h>
+#include "xu_malloc.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lua.h"
+
+/*
+ * Timer heap.
+ *
+ * A binary min heap of (deadline, id) keyed by deadline, for one actor
+ * to keep its timers and arm a single kernel timeout for the nearest
+ * one.  An entry is named by a `ref' returned from push, stable while
+ * the entry is in the heap, so remove and update are O(log n).
+ */
+#define TMHEAP_NAME    "tmheap"
+#define TMHEAP_VERSION "1.0"
+#define TMHEAP_MTCLASS "mt.TmHeap"
+#define TMHEAP() (luaL_checkudata(L, 1, TMHEAP_MTCLASS))
+
+struct tmnode {
+	int64_t     deadline;
+	uint64_t    seq;   /* insertion order, among equal deadlines */
+	lua_Integer id;
+	int         pos;   /* index in heap, -1 when free */
+	int         next;  /* free list */
+};
+
+struct tmheap {
+	struct tmnode *node;  /* by ref, ref 0 unused */
+	int           *heap;  /* refs */
+	int            size;
+	int            cap;
+	int            free;
+	uint64_t       seq;
+};
+
+static inline int __less(struct tmheap *h, int a, int b)
+{
+	struct tmnode *x = &h->node[h->heap[a]], *y = &h->node[h->heap[b]];
+
+	return x->deadline < y->deadline || (x->deadline == y->deadline && x->seq < y->seq);
+}
+
+static inline void __swap(struct tmheap *h, int a, int b)
+{
+	int r = h->heap[a];
+
+	h->heap[a] = h->heap[b];
+	h->heap[b] = r;
+	h->node[h->heap[a]].pos = a;
+	h->node[h->heap[b]].pos = b;
+}
+
+static void __up(struct tmheap *h, int i)
+{
+	while (i > 0 && __less(h, i, (i - 1) / 2)) {
+		__swap(h, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void __down(struct tmheap *h, int i)
+{
+	int c;
+
+	while ((c = 2 * i + 1) < h->size) {
+		if (c + 1 < h->size && __less(h, c + 1, c))
+			c++;
+		if (!__less(h, c, i))
+			break;
+		__swap(h, i, c);
+		i = c;
+	}
+}
+
+static void __grow(struct tmheap *h)
+{
+	int i, cap = h->cap ? h->cap * 2 : 16;
+
+	h->node = xu_realloc(h->node, (cap + 1) * sizeof h->node[0]);
+	h->heap = xu_realloc(h->heap, cap * sizeof h->heap[0]);
+	/* refs cap..h->cap+1 on the free list, lowest first */
+	for (i = cap; i > h->cap; --i) {
+		h->node[i].pos = -1;
+		h->node[i].next = h->free;
+		h->free = i;
+	}
+	h->cap = cap;
+}
+
+static void __remove(struct tmheap *h, int ref)
+{
+	int i = h->node[ref].pos, last;
+
+	if (i != --h->size) {
+		__swap(h, i, h->size);
+		last = h->heap[i];
+		__up(h, i);
+		__down(h, h->node[last].pos);
+	}
+	h->node[ref].pos = -1;
+	h->node[ref].next = h->free;
+	h->free = ref;
+}
+
+static int __checkref(lua_State *L, struct tmheap *h)
+{
+	lua_Integer ref = luaL_checkinteger(L, 2);
+
+	if (ref <= 0 || ref > h->cap || h->node[ref].pos < 0)
+		return 0;
+	return (int)ref;
+}
+
+static int __tmheap_new(lua_State *L)
+{
+	struct tmheap *h = lua_newuserdata(L, sizeof *h);
+
+	memset(h, 0, sizeof *h);
+	luaL_getmetatable(L, TMHEAP_MTCLASS);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+/* h:push(deadline, id) -> ref */
+static int __tmheap_push(lua_State *L)
+{
+	struct tmheap *h = TMHEAP();
+	int64_t deadline = luaL_checkinteger(L, 2);
+	lua_Integer id = luaL_checkinteger(L, 3);
+	int ref;
+
+	if (h->free == 0)
+		__grow(h);
+	ref = h->free;
+	h->free = h->node[ref].next;
+	h->node[ref].deadline = deadline;
+	h->node[ref].seq = h->seq++;
+	h->node[ref].id = id;
+	h->node[ref].pos = h->size;
+	h->heap[h->size++] = ref;
+	__up(h, h->size - 1);
+	lua_pushinteger(L, ref);
+	return 1;
+}
+
+/* h:remove(ref) -> true if it was in */
+static int __tmheap_remove(lua_State *L)
+{
+	struct tmheap *h = TMHEAP();
+	int ref = __checkref(L, h);
+
+	if (ref)
+		__remove(h, ref);
+	lua_pushboolean(L, ref != 0);
+	return 1;
+}
+
+/* h:update(ref, deadline) -> true if it was in */
+static int __tmheap_update(lua_State *L)
+{
+	struct tmheap *h = TMHEAP();
+	int ref = __checkref(L, h);
+	struct tmnode *n;
+
+	if (ref) {
+		n = &h->node[ref];
+		n->deadline = luaL_checkinteger(L, 3);
+		n->seq = h->seq++;
+		__up(h, n->pos);
+		__down(h, n->pos);
+	}
+	lua_pushboolean(L, ref != 0);
+	return 1;
+}
+
+/* h:top() -> deadline, id, ref of the nearest one, nil if empty */
+static int __tmheap_top(lua_State *L)
+{
+	struct tmheap *h = TMHEAP();
+	struct tmnode *n;
+
+	if (h->size == 0)
+		return 0;
+	n = &h->node[h->heap[0]];
+	lua_pushinteger(L, n->deadline);
+	lua_pushinteger(L, n->id);
+	lua_pushinteger(L, h->heap[0]);
+	return 3;
+}
+
+/* h:pop(now) -> id, ref of the nearest one if due by `now', else nil */
+static int __tmheap_pop(lua_State *L)
+{
+	struct tmheap *h = TMHEAP();
+	int64_t now = luaL_checkinteger(L, 2);
+	int ref;
+
+	if (h->size == 0 || h->node[h->heap[0]].deadline > now)
+		return 0;
+	ref = h->heap[0];
+	__remove(h, ref);
+	lua_pushinteger(L, h->node[ref].id);
+	lua_pushinteger(L, ref);
+	return 2;
+}
+
+static int __tmheap_size(lua_State *L)
+{
+	struct tmheap *h = TMHEAP();
+
+	lua_pushinteger(L, h->size);
+	return 1;
+}
+
+static int __tmheap_gc(lua_State *L)
+{
+	struct tmheap *h = TMHEAP();
+
+	xu_free(h->node);
+	xu_free(h->heap);
+	memset(h, 0, sizeof *h);
+	return 0;
+}
+
+int luaopen_tmheap(lua_State *L)
+{
+	luaL_Reg r[] = {
+		{"new", __tmheap_new},
+		{NULL, NULL}
+	};
+
+	luaL_Reg mt_r[] = {
+		{"push",   __tmheap_push},
+		{"remove", __tmheap_remove},
+		{"update", __tmheap_update},
+		{"top",    __tmheap_top},
+		{"pop",    __tmheap_pop},
+		{"size",   __tmheap_size},
+		{"__len",  __tmheap_size},
+		{"__gc",   __tmheap_gc},
+		{NULL, NULL}
+	};
+
+	luaL_newmetatable(L, TMHEAP_MTCLASS);
+	lua_pushstring(L, "__index");
+	lua_pushvalue(L, -2);
+	lua_settable(L, -3);
+	luaL_setfuncs(L, mt_r, 0);
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	luaL_setfuncs(L, r, 0);
+
+	/* module name and version */
+	lua_pushliteral(L, TMHEAP_NAME);
+	lua_setfield(L, -2, "_NAME");
+	lua_pushliteral(L, TMHEAP_VERSION);
+	lua_setfield(L, -2, "_VERSION");
+
+	return 1;
+}
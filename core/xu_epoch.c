@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "xu_impl.h"
+
+/*
+ * Epoch based reclamation.
+ *
+ * Readers announce the global epoch they entered in, writers unlink an
+ * object first and defer its release, tagged with the epoch at unlink
+ * time.  The object is released once every thread still reading entered
+ * in a later epoch, such a thread can't have seen it.
+ */
+struct erecord {
+	struct erecord *next;
+	uint64_t epoch;  /* 0: not reading */
+	int depth;
+	int init;
+};
+
+struct limbo {
+	struct limbo *next;
+	uint64_t epoch;
+	void *p;
+	void (*release)(void *);
+};
+
+struct epoch_mgr {
+	uint64_t epoch;
+	struct spinlock lock;
+	struct erecord *records;
+	struct limbo *limbo;
+	pthread_key_t key;
+	int init;
+};
+
+static struct epoch_mgr _E[1] = {{ .epoch = 1 }};
+static __thread struct erecord __er;
+
+static void __record_exit(void *ud)
+{
+	struct erecord *r = ud, **it;
+
+	SPIN_LOCK(_E);
+	for (it = &_E->records; *it; it = &(*it)->next) {
+		if (*it == r) {
+			*it = r->next;
+			break;
+		}
+	}
+	SPIN_UNLOCK(_E);
+	r->init = 0;
+}
+
+static void __record_init(struct erecord *r)
+{
+	SPIN_LOCK(_E);
+	if (!_E->init) {
+		pthread_key_create(&_E->key, __record_exit);
+		_E->init = 1;
+	}
+	r->epoch = 0;
+	r->depth = 0;
+	r->next = _E->records;
+	_E->records = r;
+	SPIN_UNLOCK(_E);
+	pthread_setspecific(_E->key, r);
+	r->init = 1;
+}
+
+void xu_epoch_enter(void)
+{
+	struct erecord *r = &__er;
+
+	if (!r->init)
+		__record_init(r);
+	if (r->depth++ == 0) {
+		/* a full barrier: publish the epoch before reading any pointer */
+		__atomic_exchange_n(&r->epoch, _E->epoch, __ATOMIC_SEQ_CST);
+	}
+}
+
+void xu_epoch_exit(void)
+{
+	struct erecord *r = &__er;
+
+	if (--r->depth == 0)
+		ATOM_STORE_RELEASE(&r->epoch, 0);
+}
+
+void xu_epoch_reclaim(void)
+{
+	struct erecord *r;
+	struct limbo *l, *next, **it, *done = NULL;
+	uint64_t e, min = UINT64_MAX;
+
+	if (_E->limbo == NULL)
+		return;
+	SPIN_LOCK(_E);
+	__sync_synchronize();
+	for (r = _E->records; r; r = r->next) {
+		e = ATOM_LOAD_ACQUIRE(&r->epoch);
+		if (e != 0 && e < min)
+			min = e;
+	}
+	for (it = &_E->limbo; (l = *it) != NULL; ) {
+		if (l->epoch < min) {
+			*it = l->next;
+			l->next = done;
+			done = l;
+		} else {
+			it = &l->next;
+		}
+	}
+	SPIN_UNLOCK(_E);
+
+	for (l = done; l; l = next) {
+		next = l->next;
+		l->release(l->p);
+		xu_free(l);
+	}
+}
+
+void xu_epoch_defer(void *p, void (*release)(void *))
+{
+	struct limbo *l = xu_malloc(sizeof *l);
+
+	l->p = p;
+	l->release = release;
+	SPIN_LOCK(_E);
+	/* p is unlinked already, readers entering from now on can't see it */
+	l->epoch = ATOM_FINC(&_E->epoch);
+	l->next = _E->limbo;
+	_E->limbo = l;
+	SPIN_UNLOCK(_E);
+
+	xu_epoch_reclaim();
+}
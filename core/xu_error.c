@@ -12,10 +12,9 @@
 
 void xu_error(struct xu_actor * context, const char *msg, ...)
 {
-	static uint32_t logger = 0;
-	if (logger == 0) {
-		logger = xu_actor_findname("logger");
-	}
+	static __thread struct xu_name_cache nc;
+	uint32_t logger = xu_actor_findname_cached(&nc, "logger");
+
 	if (logger == 0) {
 		return;
 	}
@@ -29,23 +28,24 @@ void xu_error(struct xu_actor * context, const char *msg, ...)
 	int len = vsnprintf(tmp, LOG_MESSAGE_SIZE, msg, ap);
 	va_end(ap);
 	if (len >=0 && len < LOG_MESSAGE_SIZE) {
-		data = xu_strdup(tmp);
+		data = xu_msg_alloc(len + 1);
+		memcpy(data, tmp, len + 1);
 	} else {
 		int max_size = LOG_MESSAGE_SIZE;
 		for (;;) {
 			max_size *= 2;
-			data = xu_malloc(max_size);
+			data = xu_msg_alloc(max_size);
 			va_start(ap,msg);
 			len = vsnprintf(data, max_size, msg, ap);
 			va_end(ap);
 			if (len < max_size) {
 				break;
 			}
-			xu_free(data);
+			xu_msg_free(data);
 		}
 	}
 	if (len < 0) {
-		xu_free(data);
+		xu_msg_free(data);
 		perror("vsnprintf error :");
 		return;
 	}
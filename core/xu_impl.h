@@ -14,14 +14,61 @@
 #include "xu_util.h"
 
 struct xu_actor;
+struct xu_msg;
+struct queue;
+
+/* actor mailbox */
+#define MQ_OK       0
+#define MQ_SHED     1  /* queued, the oldest message will be discarded */
+#define MQ_DROPPED  2  /* not queued, dropped silently */
+#define MQ_FULL     3  /* not queued, rejected */
+
+struct queue *xu_queue_new(uint32_t handle);
+/* cap <= 0: unbounded. */
+void xu_queue_limit(struct queue *q, int cap, int policy, uint32_t supervisor);
+int xu_queue_put(struct queue *q, struct xu_msg *msg);
+int xu_queue_get(struct queue *q, struct xu_msg *msg);
+/* move up to n messages out of the mailbox, return the count. */
+int xu_queue_get_batch(struct queue *q, struct xu_msg *msgs, int n);
+uint32_t xu_queue_length(struct queue *q);
+void xu_queue_push(struct queue *q);
+struct queue *xu_queue_pop(void);
+void xu_queue_free(struct queue *q);
+/* copied payloads up to `max' bytes are stored in the mailbox slot. */
+void xu_msg_inline(int max);
+
+/* scheduler */
+#define XU_SCHED_GLOBAL 0
+#define XU_SCHED_STEAL  1
+
+void xu_sched_init(int workers, int steal);
+/* bind the calling thread to worker `id', -1 to unbind. */
+void xu_sched_worker(int id);
+/* wake up a parked worker thread. */
+void xu_worker_wakeup(void);
+
+/*
+ * epoch based reclamation: lock-free readers run between enter/exit,
+ * objects they may see are released through xu_epoch_defer.
+ */
+void xu_epoch_enter(void);
+void xu_epoch_exit(void);
+void xu_epoch_defer(void *p, void (*release)(void *));
+void xu_epoch_reclaim(void);
+
+/* batched timeouts, see xu_actor_batch_timeouts */
+int xu_actor_timerbatch(struct xu_actor *ctx);
+int xu_timerbatch_actors(void);
 
 void xu_timer_init(void);
 uint64_t xu_starttime(void);
 void xu_updatetime(void);
+uint32_t xu_timer_tick(void);
 
 void xu_kern_global_init(const char *mod_path);
 void xu_io_init(void);
-void xu_io_gc(void);
+/* the actor is gone, close the IO handles it owns */
+void xu_io_owner_exit(uint32_t handle);
 
 int xu_actors_total();
 void xu_log_output(FILE *f, uint32_t source, int type, const void * buffer, size_t sz);
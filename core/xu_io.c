@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,6 +6,8 @@
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stddef.h>
+#include <sys/socket.h>
 #include "uv.h"
 #include "xu_impl.h"
 #include "xu_kern.h"
@@ -13,6 +16,23 @@
 #include "list.h"
 
 #define TCP_BACKLOG (32)
+#define IO_INDEX_SIZE (256) /* initial fdesc buckets, doubled as needed */
+
+/* TCP read buffers, event header included, learnt per connection */
+#define IO_RDBUF_MIN   XU_MPOOL_MAX
+#define IO_RDBUF_INIT  (2048)
+#define IO_RDBUF_MAX   (65536)
+#define IO_RDBUF_SLOW  (4) /* small reads in a row before shrinking */
+
+#define IO_WRITE_BUFS  (64) /* writes merged in one uv_write at most */
+
+/* batched UDP, datagrams per recvmmsg / sendmmsg */
+#if defined(__linux__)
+#define IO_UDP_MMSG
+#endif
+#define IO_UDP_BATCH   (32)
+#define IO_UDP_BATCH_BUF (65536) /* a batch buffer holds no more slots than fit */
+#define IO_DGRAM_MAX   (65507)
 
 #define XU_IO_TCP  1
 #define XU_IO_UDP  2
@@ -26,6 +46,7 @@
 #define IO_REQ_MEMBERSHIP  7
 #define IO_REQ_FLAGS       8
 #define IO_REQ_POLLFD      9
+#define IO_REQ_OWNER_EXIT  10
 
 struct req_host {
 	uint16_t  protocol;
@@ -33,15 +54,18 @@ struct req_host {
 	char      host[0];
 };
 
+/* `owned' data is a xu_malloc block of the caller, freed with the request */
 struct req_write {
 	size_t         len;
 	void    *data;
+	int      owned;
 };
 
 struct req_usend {
 	union sockaddr_all addr;
 	size_t     len;
 	void      *data;
+	int        owned;
 };
 
 struct req_uopen {
@@ -62,6 +86,8 @@ struct req_membership {
 #define REQ_FLAGS_UDP_MCAST_TTL  4
 #define REQ_FLAGS_TCP_NODELAY    5
 #define REQ_FLAGS_TCP_KEEPALIVE  6
+#define REQ_FLAGS_TCP_CORK       7
+#define REQ_FLAGS_UDP_BATCH      8
 struct req_flags {
 	int flag;
 	int how;
@@ -76,10 +102,15 @@ struct header {
 	uint32_t      fdesc;
 };
 
+/*
+ * Requests are passed to the IO thread through a lock-free list: any
+ * thread pushes, the IO thread takes the whole list at once.  A request
+ * is allocated as large as its payload, data to write follows it.
+ */
 struct request {
+	struct request *next;
 	struct header header;
 	union {
-		char buffer[512];
 		int  reserved;
 		struct req_host host;
 		struct req_write  write;
@@ -107,20 +138,56 @@ struct iohandle {
 		uv_tty_t    tty;
 	} u;
 
-	struct list_head link;
+	struct hlist_node hnode; /* fdesc index */
+	struct hlist_node onode; /* owner index */
 
 	uint32_t owner;
 	uint32_t handle;
 	int      protocol;
 	int      flag;
+	uint32_t rdsize;  /* next read buffer */
+	uint32_t rdsmall; /* reads below a quarter of it in a row */
+
+	/*
+	 * Write requests wait here, the ones arrived during a request drain
+	 * go out together in one uv_write after it, see __flush.
+	 */
+	struct request  *wq;
+	struct request **wq_tail;
+	struct list_head dirty;   /* in io_context.dirty, writes to flush */
+	int      corked;
+	int      writing;         /* a uv_write in flight */
+
+	uint32_t batch;           /* UDP: largest datagram of a batch, 0 off */
+	uint32_t slots;           /* datagrams a batch buffer holds */
+	struct xu_io_event *spare; /* batch buffer a receive left unused */
+};
+
+struct io_write {
+	uv_write_t       req;
+	struct iohandle *io;
+	struct request  *reqs;
+	uv_buf_t         bufs[0];
+};
+
+struct io_send {
+	uv_udp_send_t    req;
+	struct iohandle *io;
+	struct request  *r;
 };
 
 struct io_context {
-	uv_poll_t recvfd;
+	uv_async_t wakeup;
+
+	struct request *reqs;  /* pushed, newest first */
 
-	int sendfd;
+	struct list_head dirty;
 
-	struct list_head io;
+	/* fdesc -> iohandle and owner -> iohandles, IO thread only */
+	struct hlist_head *index;
+	struct hlist_head *owners;
+	uint32_t index_size;
+	uint32_t index_count;
 
 	uint32_t handle_index;
 	struct spinlock lock;
@@ -139,16 +206,6 @@ static inline int __read(int fd, void *buf, int len)
 	return (r);
 }
 
-static inline int __write(int fd, void *buf, int len)
-{
-	int r;
-
-	do {
-		r = write(fd, buf, len);
-	} while ((r == -1) && (errno == EINTR || errno == EAGAIN));
-	return (r);
-}
-
 static uint32_t __get_fdesc()
 {
 	uint32_t h;
@@ -162,13 +219,32 @@ static uint32_t __get_fdesc()
 	return (h);
 }
 
+static void __free_req(struct request *req)
+{
+	int type = req->header.head >> REQ_TYPE_SHIFT;
+
+	if (type == IO_REQ_WRITE && req->u.write.owned)
+		xu_free(req->u.write.data);
+	else if (type == IO_REQ_UDPSEND && req->u.usend.owned)
+		xu_free(req->u.usend.data);
+	xu_msg_free(req);
+}
+
 static void __on_close(uv_handle_t *h)
 {
 	struct iohandle *ih = (struct iohandle *)h;
+	struct request *r, *next;
 
 	assert(ih->handle != 0);
+	assert(hlist_unhashed(&ih->hnode));
 	xu_error(NULL, "freeing owner [%u]  fd[%u] %p", ih->owner, ih->handle, ih);
 
+	for (r = ih->wq; r; r = next) {
+		next = r->next;
+		__free_req(r);
+	}
+	if (ih->spare)
+		xu_msg_free(ih->spare);
 	xu_free(ih);
 }
 
@@ -189,20 +265,63 @@ static void __report_eorc(uint32_t owner, int eorc, uint32_t fd, int errcode)
 	}
 }
 
+static inline struct hlist_head *__owner_bucket(struct io_context *ic, uint32_t owner)
+{
+	/* handles of actors started one after another spread out */
+	return &ic->owners[(owner * 2654435761u) >> 8 & (ic->index_size - 1)];
+}
+
+static void __index_grow(struct io_context *ic)
+{
+	struct hlist_head *old = ic->index, *oldo = ic->owners;
+	struct iohandle *it;
+	struct hlist_node *n;
+	uint32_t i, size = ic->index_size;
+
+	ic->index_size = size ? size * 2 : IO_INDEX_SIZE;
+	ic->index = xu_calloc(ic->index_size, sizeof ic->index[0]);
+	ic->owners = xu_calloc(ic->index_size, sizeof ic->owners[0]);
+	for (i = 0; i < size; ++i) {
+		hlist_for_each_entry_safe(it, n, &old[i], hnode) {
+			hlist_add_head(&it->hnode, &ic->index[it->handle & (ic->index_size - 1)]);
+		}
+		hlist_for_each_entry_safe(it, n, &oldo[i], onode) {
+			hlist_add_head(&it->onode, __owner_bucket(ic, it->owner));
+		}
+	}
+	xu_free(old);
+	xu_free(oldo);
+}
+
+static void __index_add(struct io_context *ic, struct iohandle *io)
+{
+	if (ic->index_count >= ic->index_size)
+		__index_grow(ic);
+	hlist_add_head(&io->hnode, &ic->index[io->handle & (ic->index_size - 1)]);
+	hlist_add_head(&io->onode, __owner_bucket(ic, io->owner));
+	ic->index_count++;
+}
+
+/* out of the index and the list, no more requests reach it */
+static void __unlink_handle(struct io_context *ic, struct iohandle *io)
+{
+	if (!hlist_unhashed(&io->hnode)) {
+		hlist_del(&io->hnode);
+		hlist_del(&io->onode);
+		ic->index_count--;
+	}
+	list_del_init(&io->dirty);
+	io->flag = IO_HF_CLOSING;
+}
+
 static void __close_handle(struct iohandle *io, int reason)
 {
-	struct xu_actor *ctx;
 	if (io->flag != IO_HF_CLOSING) {
 		uv_close(&io->u.handle, __on_close);
 
-		io->flag = IO_HF_CLOSING;
+		__unlink_handle(_ioc, io);
 
-		list_del(&io->link);
-
-		ctx = xu_handle_ref(io->owner);
-		if (ctx) {
-			__report_eorc(io->owner, XIE_EVENT_CLOSE, io->handle, reason);
-		}
+		__report_eorc(io->owner, XIE_EVENT_CLOSE, io->handle, reason);
 	}
 }
 
@@ -233,36 +352,40 @@ static void __report_drain(uint32_t owner, uint32_t fd, int code)
 		xie.event = XIE_EVENT_DRAIN;
 		xie.u.errcode = code;
 		xu_send(xa, 0, owner, MTYPE_IO, &xie, sizeof xie);
+		xu_actor_unref(xa);
 	}
 }
 
-static struct iohandle *alloc_iohandle(struct io_context *ic)
+static struct iohandle *alloc_iohandle(struct io_context *ic, uint32_t owner, uint32_t fdesc)
 {
 	struct iohandle *ioh = NULL;
 
 	ioh = xu_calloc(1, sizeof *ioh);
 
-	INIT_LIST_HEAD(&ioh->link);
+	INIT_LIST_HEAD(&ioh->dirty);
+	INIT_HLIST_NODE(&ioh->hnode);
+	ioh->wq_tail = &ioh->wq;
 	ioh->flag = IO_HF_IDLE;
+	ioh->owner = owner;
+	ioh->handle = fdesc;
 
-	list_add(&ioh->link, &ic->io);
+	__index_add(ic, ioh);
 
 	return ioh;
 }
 
-void xu_io_gc(void)
+/*
+ * Close every handle of a dead owner, the handles are found through the
+ * owner index, xu_actor_unref asks for it with xu_io_owner_exit.
+ */
+static void __close_owner(struct io_context *ic, uint32_t owner)
 {
-	struct xu_actor *ctx;
-	struct iohandle *it, *n;
+	struct iohandle *it;
+	struct hlist_node *n;
 
-	list_for_each_entry_safe(it, n, &_ioc->io, link) {
-		ctx = xu_handle_ref(it->owner);
-		if (!ctx) {
-			xu_error(NULL, ":%08x dead?", it->owner);
+	hlist_for_each_entry_safe(it, n, __owner_bucket(ic, owner), onode) {
+		if (it->owner == owner)
 			__close_handle(it, 0);
-		} else {
-			xu_actor_unref(ctx);
-		}
 	}
 }
 
@@ -270,9 +393,11 @@ static struct iohandle *__find_io(struct io_context *ic, uint32_t owner, uint32_
 {
 	struct iohandle *h = NULL, *it;
 
-	list_for_each_entry(it, &ic->io, link) {
-		if (it->flag != IO_HF_IDLE && it->owner == owner && it->handle == fdesc) {
-			h = it;
+	hlist_for_each_entry(it, &ic->index[fdesc & (ic->index_size - 1)], hnode) {
+		if (it->handle == fdesc) {
+			/* fdesc of another actor */
+			if (it->flag != IO_HF_IDLE && it->owner == owner)
+				h = it;
 			break;
 		}
 	}
@@ -287,15 +412,91 @@ struct dnsreq {
 	int      proto;
 };
 
+/*
+ * Reads land in the message sent to the owner: the buffer is the data of
+ * an xu_io_event allocated from the payload pool.
+ */
 static void __on_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf)
 {
-	buf->base = xu_calloc(1, size);
-	buf->len  = size;
+	struct iohandle *io = (struct iohandle *)handle;
+	struct xu_io_event *xie;
+
+	/* a datagram doesn't come in pieces, take the suggested size */
+	if (handle->type == UV_TCP) {
+		if (io->rdsize == 0)
+			io->rdsize = IO_RDBUF_INIT;
+		size = io->rdsize;
+	} else if (io->batch) {
+		/* room for a batch, libuv reads the first one in slot 0 */
+		if ((xie = io->spare) != NULL) {
+			io->spare = NULL;
+		} else {
+			size = sizeof *xie + io->slots * XU_IO_DGRAM_SIZE(io->batch);
+			xie = xu_msg_alloc(size);
+		}
+		memset(xie, 0, sizeof *xie);
+		buf->base = xie->data + sizeof(struct xu_io_dgram);
+		buf->len  = io->batch;
+		return;
+	} else {
+		size += sizeof *xie;
+	}
+	xie = xu_msg_alloc(size);
+	memset(xie, 0, sizeof *xie);
+	buf->base = xie->data;
+	buf->len  = size - sizeof *xie;
+}
+
+static inline struct xu_io_event *__buf_event(struct iohandle *io, const uv_buf_t *buf)
+{
+	char *base = buf->base;
+
+	if (base && io->u.handle.type == UV_UDP && io->batch)
+		base -= sizeof(struct xu_io_dgram);
+	return base ? container_of((void *)base, struct xu_io_event, data) : NULL;
+}
+
+/* grow on full reads, shrink after a few small ones */
+static void __rdsize_learn(struct iohandle *io, size_t nread, size_t len)
+{
+	if (nread >= len) {
+		if (io->rdsize < IO_RDBUF_MAX)
+			io->rdsize *= 2;
+		io->rdsmall = 0;
+	} else if (nread <= len / 4 && io->rdsize > IO_RDBUF_MIN) {
+		if (++io->rdsmall >= IO_RDBUF_SLOW) {
+			io->rdsize /= 2;
+			io->rdsmall = 0;
+		}
+	} else {
+		io->rdsmall = 0;
+	}
 }
 
-static void __on_tcp_read(uv_stream_t *stream, int nread, const uv_buf_t *buf)
+/* pass a read to the owner, the unused tail of a big buffer is given back */
+static void __deliver(struct iohandle *io, struct xu_io_event *xie, int event, size_t nread)
+{
+	struct xu_actor *ctx;
+
+	xie = xu_msg_shrink(xie, sizeof *xie + nread);
+	xie->fdesc = io->handle;
+	xie->event = event;
+	xie->size = nread;
+
+	ctx = xu_handle_ref(io->owner);
+	if (ctx) {
+		xu_send(ctx, 0, io->owner, (MTYPE_IO | MTYPE_TAG_DONTCOPY), xie, sizeof *xie + nread);
+		xu_actor_unref(ctx);
+	} else { /* actor dead ? */
+		xu_msg_free(xie);
+		__close_handle(io, XIE_ERR_RECV_DATA);
+	}
+}
+
+static void __on_tcp_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
 {
 	struct iohandle *tcp = (struct iohandle *)stream;
+	struct xu_io_event *xie = __buf_event(tcp, buf);
 
 	if (nread == 0) {
 		goto skip;
@@ -307,6 +508,8 @@ static void __on_tcp_read(uv_stream_t *stream, int nread, const uv_buf_t *buf)
 		uv_fileno(&tcp->u.handle, &fd);
 		ctx = xu_handle_ref(tcp->owner);
 		xu_error(ctx, "fdesc %u eof real fd  %d.", tcp->handle, fd);
+		if (ctx)
+			xu_actor_unref(ctx);
 		/*
 		 * report close event.
 		 */
@@ -316,27 +519,12 @@ static void __on_tcp_read(uv_stream_t *stream, int nread, const uv_buf_t *buf)
 	}
 
 	if (nread > 0) {
-		struct xu_io_event *xie;
-
-		xie = xu_malloc(sizeof *xie + nread);
-
-		xie->fdesc = tcp->handle;
-
-		xie->event = XIE_EVENT_DATA;
-		xie->size = nread;
-		memcpy(xie->data, buf->base, nread);
-
-		struct xu_actor *ctx = xu_handle_ref(tcp->owner);
-		if (ctx) {
-			xu_send(ctx, 0, tcp->owner, (MTYPE_IO | MTYPE_TAG_DONTCOPY), xie, sizeof xie + nread);
-			xu_actor_unref(ctx);
-		} else {/* actor dead ? */
-			__close_handle(tcp, XIE_ERR_RECV_DATA);
-		}
+		__rdsize_learn(tcp, nread, buf->len);
+		__deliver(tcp, xie, XIE_EVENT_DATA, nread);
+		return;
 	} /* XXX: nread < 0 case */
 skip:
-	if (buf->base)
-		xu_free(buf->base);
+	xu_msg_free(xie);
 }
 
 static void __on_accept(uv_stream_t *stream, int err)
@@ -346,7 +534,7 @@ static void __on_accept(uv_stream_t *stream, int err)
 	if (err == 0) {
 		uv_loop_t *loop = uv_default_loop();
 		server = (struct iohandle *)stream;
-		ioh = alloc_iohandle(_ioc);
+		ioh = alloc_iohandle(_ioc, server->owner, __get_fdesc());
 		uv_tcp_init(loop, &ioh->u.tcp);
 
 		if (uv_accept(stream, &ioh->u.stream) == 0) {
@@ -355,9 +543,7 @@ static void __on_accept(uv_stream_t *stream, int err)
 			/* check owner is alive */
 			ioh->flag = IO_HF_CONNECTED;
 			ioh->protocol = server->protocol;
-			ioh->owner = server->owner;
 			/* new connection */
-			ioh->handle = __get_fdesc();
 			namelen = sizeof sal;
 			uv_tcp_getpeername(&ioh->u.tcp, (void *)&sal, &namelen);
 			__report_eorc(ioh->owner, XIE_EVENT_CONNECTION, server->handle, ioh->handle);
@@ -365,9 +551,11 @@ static void __on_accept(uv_stream_t *stream, int err)
 			uv_read_start(&ioh->u.stream, __on_alloc, __on_tcp_read);
 		} else {
 			xu_error(NULL, "handle :%0x accept failed.", server->owner);
+			/* never reported, drop it quietly */
+			__unlink_handle(_ioc, ioh);
+			uv_close(&ioh->u.handle, __on_close);
 		}
 	}
-	xu_io_gc();
 }
 
 static int __listen_tcp(struct iohandle *ioh, struct addrinfo *ai)
@@ -390,37 +578,84 @@ static int __listen_tcp(struct iohandle *ioh, struct addrinfo *ai)
 	return err;
 }
 
+#ifdef IO_UDP_MMSG
+/*
+ * The datagram libuv has read is in slot 0, read what else is waiting
+ * with one recvmmsg into the other slots, then pack them behind it.
+ */
+static size_t __udp_recv_batch(struct iohandle *udp, struct xu_io_event *xie,
+		size_t nread, const struct sockaddr *addr)
+{
+	struct mmsghdr msgs[IO_UDP_BATCH - 1];
+	struct iovec iov[IO_UDP_BATCH - 1];
+	union sockaddr_all sa[IO_UDP_BATCH - 1];
+	size_t slot = XU_IO_DGRAM_SIZE(udp->batch), off;
+	struct xu_io_dgram *dg = (struct xu_io_dgram *)xie->data;
+	int i, n, fd, count = 1, m = udp->slots - 1;
+
+	memset(&dg->addr, 0, sizeof dg->addr);
+	memcpy(&dg->addr, addr, addr->sa_family == AF_INET6 ?
+			sizeof dg->addr.in6 : sizeof dg->addr.in4);
+	dg->len = nread;
+	off = XU_IO_DGRAM_SIZE(nread);
+
+	memset(msgs, 0, sizeof msgs);
+	for (i = 0; i < m; i++) {
+		iov[i].iov_base = xie->data + (i + 1) * slot + sizeof *dg;
+		iov[i].iov_len  = udp->batch;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &sa[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof sa[i];
+	}
+	if (m == 0 || uv_fileno(&udp->u.handle, &fd) != 0)
+		n = 0;
+	else if ((n = recvmmsg(fd, msgs, m, MSG_DONTWAIT, NULL)) < 0)
+		n = 0;
+
+	for (i = 0; i < n; i++) {
+		/* larger than the batch allows, dropped */
+		if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+			continue;
+		dg = (struct xu_io_dgram *)(xie->data + off);
+		memmove(dg->data, iov[i].iov_base, msgs[i].msg_len);
+		dg->addr = sa[i];
+		dg->len = msgs[i].msg_len;
+		off += XU_IO_DGRAM_SIZE(dg->len);
+		count++;
+	}
+	xie->u.errcode = count;
+	return off;
+}
+#endif
+
 static void __on_udp_recv(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf,
 		const struct sockaddr *addr, unsigned int flags)
 {
 	struct iohandle *udp = (struct iohandle *)handle;
+	struct xu_io_event *xie = __buf_event(udp, buf);
 
-	if (nread == 0 && addr == NULL) {
-		goto skip;
+#ifdef IO_UDP_MMSG
+	if (udp->batch && xie) {
+		if (nread > 0 && !(flags & UV_UDP_PARTIAL)) {
+			nread = __udp_recv_batch(udp, xie, nread, addr);
+			__deliver(udp, xie, XIE_EVENT_MESSAGES, nread);
+			return;
+		}
+		/* libuv asks for a buffer once more just to see EAGAIN, keep it */
+		if (udp->spare == NULL)
+			udp->spare = xie;
+		else
+			xu_msg_free(xie);
+		return;
 	}
-
+#endif
 	if (nread > 0) {
-		struct xu_io_event *xie;
-
-		xie = xu_malloc(sizeof *xie + nread);
-
-		xie->fdesc = udp->handle;
-		xie->event = XIE_EVENT_MESSAGE;
-		xie->size = nread;
 		xie->u.sa.in = *addr;
-		memcpy(xie->data, buf->base, nread);
-
-		struct xu_actor *ctx = xu_handle_ref(udp->owner);
-		if (ctx) {
-			xu_send(ctx, 0, udp->owner, (MTYPE_IO | MTYPE_TAG_DONTCOPY), xie, sizeof xie + nread);
-			xu_actor_unref(ctx);
-		} else { /* actor dead ? */
-			__close_handle(udp, XIE_ERR_RECV_DATA);
-		}
+		__deliver(udp, xie, XIE_EVENT_MESSAGE, nread);
+		return;
 	}
-skip:
-	if (buf->base)
-		xu_free(buf->base);
+	xu_msg_free(xie);
 }
 
 static int __listen_udp(struct iohandle *ioh, struct addrinfo *ai)
@@ -441,10 +676,8 @@ static int __listen_udp(struct iohandle *ioh, struct addrinfo *ai)
 
 static void __on_dns_server(struct dnsreq *dr, int err, struct addrinfo *ai)
 {
-	struct iohandle *ioh = alloc_iohandle(_ioc);
+	struct iohandle *ioh = alloc_iohandle(_ioc, dr->owner, dr->handle);
 
-	ioh->owner = dr->owner;
-	ioh->handle = dr->handle;
 	ioh->protocol = dr->proto;
 	if (err == 0) {
 		uv_loop_t *loop = uv_default_loop();
@@ -459,7 +692,7 @@ static void __on_dns_server(struct dnsreq *dr, int err, struct addrinfo *ai)
 				break;
 			default:
 				__report_eorc(dr->owner,  XIE_EVENT_ERROR, -1, XIE_ERR_LISTEN);
-				list_del(&ioh->link);
+				__unlink_handle(_ioc, ioh);
 				xu_free(ioh);
 				return;
 		}
@@ -510,7 +743,8 @@ static void __on_dns_tcp_connect(struct dnsreq *dr, int err, struct addrinfo *ai
 		__report_eorc(dr->owner, XIE_EVENT_ERROR, dr->handle, XIE_ERR_LOOKUP);
 		return;
 	}
-	tcp = alloc_iohandle(_ioc);
+	tcp = alloc_iohandle(_ioc, dr->owner, dr->handle);
+	tcp->protocol = XU_IO_TCP;
 	req = xu_calloc(1, sizeof *req);
 	req->data = tcp;
 	ni = ai;
@@ -534,7 +768,12 @@ static void __on_dns_tcp_connect(struct dnsreq *dr, int err, struct addrinfo *ai
 static void __on_dns(uv_getaddrinfo_t *rq, int err, struct addrinfo *ai)
 {
 	struct dnsreq *dr = container_of(rq, struct dnsreq, req);
+	struct xu_actor *xa;
 
+	/* the owner exited meanwhile, its handles are closed already */
+	if ((xa = xu_handle_ref(dr->owner)) == NULL)
+		goto skip;
+	xu_actor_unref(xa);
 	if (ai == NULL) {
 		__report_eorc(dr->owner,  XIE_EVENT_ERROR, -1, XIE_ERR_LISTEN);
 		goto skip;
@@ -557,7 +796,7 @@ static void __handle_req_uopen(struct io_context *ic, struct request *req)
 	struct iohandle *udp;
 	struct req_uopen *ru = &req->u.uopen;
 
-	udp = alloc_iohandle(ic);
+	udp = alloc_iohandle(ic, req->header.owner, req->header.fdesc);
 
 	if (uv_udp_init_ex(uv_default_loop(), &udp->u.udp, ru->udp6 ? AF_INET6 : AF_INET)) {
 		/* XXX: report error */
@@ -565,8 +804,6 @@ static void __handle_req_uopen(struct io_context *ic, struct request *req)
 
 	uv_udp_recv_start(&udp->u.udp, __on_alloc, __on_udp_recv);
 
-	udp->owner = req->header.owner;
-	udp->handle = req->header.fdesc;
 	udp->flag = IO_HF_UDP_OPENED;
 }
 
@@ -614,75 +851,202 @@ static void __handle_req_host(struct io_context *ic, struct request *req)
 	}
 }
 
+static void __flush(struct iohandle *io);
+
 static void __on_write(uv_write_t *req, int err)
 {
-	struct iohandle *h = req->data;
+	struct io_write *w = container_of(req, struct io_write, req);
+	struct iohandle *h = w->io;
+	struct request *r, *next;
 
-	__report_drain(h->owner, h->handle, err);
-	xu_free(req);
+	for (r = w->reqs; r; r = next) {
+		next = r->next;
+		__free_req(r);
+	}
+	xu_free(w);
+	h->writing = 0;
+	/* one drain once all is written, not one per write */
+	if (err || h->wq == NULL)
+		__report_drain(h->owner, h->handle, err);
+	else
+		__flush(h);
 }
 
-static void __handle_req_write(struct io_context *ic, struct request *req)
+static void __flush_udp(struct iohandle *io);
+
+/* the queued writes go out as one uv_write, the rest after it is done */
+static void __flush(struct iohandle *io)
+{
+	struct io_write *w;
+	struct request *r, *last = NULL;
+	int n = 0, err;
+
+	if (io->u.handle.type == UV_UDP) {
+		__flush_udp(io);
+		return;
+	}
+	if (io->writing || io->corked || io->wq == NULL || io->flag != IO_HF_CONNECTED)
+		return;
+	for (r = io->wq; r && n < IO_WRITE_BUFS; r = r->next)
+		last = r, n++;
+	w = xu_malloc(sizeof *w + n * sizeof w->bufs[0]);
+	w->io = io;
+	w->reqs = io->wq;
+	for (n = 0, r = io->wq; ; r = r->next) {
+		w->bufs[n].base = r->u.write.data;
+		w->bufs[n].len = r->u.write.len;
+		n++;
+		if (r == last)
+			break;
+	}
+	io->wq = last->next;
+	last->next = NULL;
+	if (io->wq == NULL)
+		io->wq_tail = &io->wq;
+
+	io->writing = 1;
+	if ((err = uv_write(&w->req, &io->u.stream, w->bufs, n, __on_write)) != 0)
+		__on_write(&w->req, err);
+}
+
+static void __flush_dirty(struct io_context *ic)
+{
+	struct iohandle *it, *n;
+
+	list_for_each_entry_safe(it, n, &ic->dirty, dirty) {
+		list_del_init(&it->dirty);
+		__flush(it);
+	}
+}
+
+static inline void __mark_dirty(struct io_context *ic, struct iohandle *h)
+{
+	if (list_empty(&h->dirty))
+		list_add_tail(&h->dirty, &ic->dirty);
+}
+
+/* return 1 if the request is kept in the write queue */
+static int __handle_req_write(struct io_context *ic, struct request *req)
 {
-	struct req_write *wr = &req->u.write;
 	struct iohandle *h = __find_io(ic, req->header.owner, req->header.fdesc);
-	uv_write_t *uwr;
 
 	if (h && h->flag == IO_HF_CONNECTED) {
-		uv_buf_t buf;
-		if (wr->len <= sizeof req->u - sizeof *wr) {
-			wr->data = req->u.buffer + sizeof *wr;
-		}
-		uwr = xu_malloc(sizeof *uwr);
-		uwr->data = h;
-		buf.base = wr->data;
-		buf.len = wr->len;
-		if (uv_write(uwr, &h->u.stream, &buf, 1, __on_write)) {
-			/*
-			 * XXX: report error.
-			 */
-			xu_free(uwr);
-		}
+		req->next = NULL;
+		*h->wq_tail = req;
+		h->wq_tail = &req->next;
+		__mark_dirty(ic, h);
+		return 1;
 	}
-	if (wr->len > (sizeof req->u - sizeof *wr)) /* malloced */
-		xu_free((void *)wr->data);
+	return 0;
 }
 
 static void __on_send(uv_udp_send_t *uwr, int status)
 {
-	struct iohandle *udp = uwr->data;
+	struct io_send *us = container_of(uwr, struct io_send, req);
 
 	//printf("udp_send recv %d\n", status);
-	__report_drain(udp->owner, udp->handle, status);
-	xu_free(uwr);
+	__report_drain(us->io->owner, us->io->handle, status);
+	__free_req(us->r);
+	xu_free(us);
 }
 
-static void __handle_req_usend(struct io_context *ic, struct request *req)
+/* return 1 if the request is kept until sent */
+static int __udp_send(struct iohandle *h, struct request *req)
 {
 	struct req_usend *wr = &req->u.usend;
-	struct iohandle *h = __find_io(ic, req->header.owner, req->header.fdesc);
-	uv_udp_send_t *uwr;
+	struct io_send *us;
+	uv_buf_t buf;
+	int err;
 
-	//printf("usend_req: %p, owner: %u, fdesc: %u\n", h, req->header.owner, req->header.fdesc);
-	if (h) {
-		uv_buf_t buf;
-		if (wr->len <= sizeof req->u.buffer - sizeof *wr) {
-			wr->data = req->u.buffer + sizeof *wr;
+	us = xu_malloc(sizeof *us);
+	us->io = h;
+	us->r = req;
+	buf.base = wr->data;
+	buf.len = wr->len;
+	/* the data may be queued by libuv, it lives until __on_send */
+	if ((err = uv_udp_send(&us->req, &h->u.udp, &buf, 1, &wr->addr.in, __on_send)) != 0) {
+		__report_drain(h->owner, h->handle, err);
+		xu_free(us);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Batched datagrams go out with sendmmsg, one drain for all of them.
+ * What the socket can't take now, and all while libuv has sends queued,
+ * goes through uv_udp_send to keep the order.
+ */
+static void __flush_udp(struct iohandle *io)
+{
+	struct request *r = io->wq, *next;
+	int i, n, fd, err = 0, sent = 0;
+#ifdef IO_UDP_MMSG
+	struct mmsghdr msgs[IO_UDP_BATCH];
+	struct iovec iov[IO_UDP_BATCH];
+	struct request *batch[IO_UDP_BATCH];
+
+	if (uv_fileno(&io->u.handle, &fd) != 0)
+		fd = -1;
+	while (r && fd >= 0 && uv_udp_get_send_queue_count(&io->u.udp) == 0) {
+		memset(msgs, 0, sizeof msgs);
+		for (n = 0; r && n < IO_UDP_BATCH; r = r->next, n++) {
+			struct req_usend *ur = &r->u.usend;
+
+			batch[n] = r;
+			iov[n].iov_base = ur->data;
+			iov[n].iov_len  = ur->len;
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			msgs[n].msg_hdr.msg_name = &ur->addr;
+			msgs[n].msg_hdr.msg_namelen = ur->addr.in.sa_family == AF_INET6 ?
+				sizeof ur->addr.in6 : sizeof ur->addr.in4;
 		}
-		uwr = xu_malloc(sizeof *uwr);
-		uwr->data = h;
-		buf.base = wr->data;
-		buf.len = wr->len;
-		if (uv_udp_send(uwr, &h->u.udp, &buf, 1, &wr->addr.in, __on_send)) {
-			/*
-			 * XXX: report error.
-			 */
-			xu_free(uwr);
+		i = sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+		if (i < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				r = batch[0];
+				break;
+			}
+			/* this one can't go, drop it and go on */
+			if (err == 0)
+				err = -errno;
+			i = 1;
+		}
+		r = i < n ? batch[i] : r;
+		while (i-- > 0) {
+			__free_req(batch[i]);
+			sent++;
 		}
 	}
-	if (wr->len > sizeof req->u.buffer - sizeof *wr) {
-		xu_free(wr->data);
+#endif
+	for (; r; r = next) {
+		next = r->next;
+		if (!__udp_send(io, r))
+			__free_req(r);
+	}
+	io->wq = NULL;
+	io->wq_tail = &io->wq;
+	if (sent)
+		__report_drain(io->owner, io->handle, err);
+}
+
+static int __handle_req_usend(struct io_context *ic, struct request *req)
+{
+	struct iohandle *h = __find_io(ic, req->header.owner, req->header.fdesc);
+
+	//printf("usend_req: %p, owner: %u, fdesc: %u\n", h, req->header.owner, req->header.fdesc);
+	if (h == NULL)
+		return 0;
+	/* behind the queued ones while there are any */
+	if (h->batch || h->wq) {
+		req->next = NULL;
+		*h->wq_tail = req;
+		h->wq_tail = &req->next;
+		__mark_dirty(ic, h);
+		return 1;
 	}
+	return __udp_send(h, req);
 }
 
 static void __handle_req_close(struct io_context *ic, struct request *req)
@@ -733,6 +1097,28 @@ static void __handle_req_flags(struct io_context *ic, struct request *req)
 		case REQ_FLAGS_TCP_KEEPALIVE:
 			uv_tcp_keepalive(&h->u.tcp, rf->how, rf->reserved);
 			break;
+		case REQ_FLAGS_TCP_CORK:
+			h->corked = rf->how;
+			if (!h->corked)
+				__mark_dirty(ic, h);
+			break;
+#ifdef IO_UDP_MMSG
+		case REQ_FLAGS_UDP_BATCH:
+			if (h->u.handle.type != UV_UDP)
+				break;
+			h->batch = rf->how <= 0 ? 0 : rf->how < IO_DGRAM_MAX ? rf->how : IO_DGRAM_MAX;
+			/* a batch buffer is IO_UDP_BATCH_BUF at most, one slot at least */
+			h->slots = h->batch ? IO_UDP_BATCH_BUF / XU_IO_DGRAM_SIZE(h->batch) : 0;
+			if (h->slots > IO_UDP_BATCH)
+				h->slots = IO_UDP_BATCH;
+			else if (h->batch && h->slots == 0)
+				h->slots = 1;
+			if (h->spare) {
+				xu_msg_free(h->spare);
+				h->spare = NULL;
+			}
+			break;
+#endif
 	}
 }
 
@@ -748,7 +1134,8 @@ static void __on_poll(uv_poll_t *handle, int status, int event)
 
 	if (event & UV_READABLE) {
 		uv_fileno(&io->u.handle, &fd);
-		struct xu_io_event *xie = xu_malloc(sizeof *xie + BUFSIZ);
+		struct xu_io_event *xie = xu_msg_alloc(sizeof *xie + BUFSIZ);
+		memset(xie, 0, sizeof *xie);
 		nread = __read(fd, xie->data, BUFSIZ);
 		if (nread > 0) {
 			xie->fdesc = io->handle;
@@ -756,15 +1143,15 @@ static void __on_poll(uv_poll_t *handle, int status, int event)
 			xie->size = nread;
 			struct xu_actor *ctx = xu_handle_ref(io->owner);
 			if (ctx) {
-				xu_send(ctx, 0, io->owner, (MTYPE_IO | MTYPE_TAG_DONTCOPY), xie, sizeof xie + nread);
+				xu_send(ctx, 0, io->owner, (MTYPE_IO | MTYPE_TAG_DONTCOPY), xie, sizeof *xie + nread);
 				xu_actor_unref(ctx);
 			} else {/* actor dead ? */
-				xu_free(xie);
+				xu_msg_free(xie);
 				/* fprintf(stderr, "%s readable can't find handle\n", __func__); */
 				__close_handle(io, XIE_ERR_RECV_DATA);
 			}
 		} else { /* XXX: nread < 0 case */
-			xu_free(xie);
+			xu_msg_free(xie);
 		}
 	}
 }
@@ -773,16 +1160,14 @@ static void __handle_req_pollfd(struct io_context *ic, struct request *req)
 {
 	struct iohandle *io;
 	
-	io = alloc_iohandle(ic);
-
-	io->owner = req->header.owner;
-	io->handle = req->header.fdesc;
+	io = alloc_iohandle(ic, req->header.owner, req->header.fdesc);
 
 	uv_poll_init(uv_default_loop(), &io->u.fd, req->u.reserved);
 	uv_poll_start(&io->u.fd, UV_READABLE, __on_poll);
 }
 
-static void __handle_req(struct io_context *ic, struct request *req)
+/* return 1 if the handler kept the request */
+static int __handle_req(struct io_context *ic, struct request *req)
 {
 	struct header *hr = &req->header;
 	int type = hr->head >> REQ_TYPE_SHIFT;
@@ -792,11 +1177,9 @@ static void __handle_req(struct io_context *ic, struct request *req)
 			__handle_req_host(ic, req);
 			break;
 		case IO_REQ_WRITE:
-			__handle_req_write(ic, req);
-			break;
+			return __handle_req_write(ic, req);
 		case IO_REQ_UDPSEND:
-			__handle_req_usend(ic, req);
-			break;
+			return __handle_req_usend(ic, req);
 		case IO_REQ_CLOSE:
 			__handle_req_close(ic, req);
 			break;
@@ -812,107 +1195,94 @@ static void __handle_req(struct io_context *ic, struct request *req)
 		case IO_REQ_POLLFD:
 			__handle_req_pollfd(ic, req);
 			break;
+		case IO_REQ_OWNER_EXIT:
+			__close_owner(ic, hr->owner);
+			break;
 	}
+	return 0;
+}
+
+static struct request *__new_req(int reqlen)
+{
+	struct request *req = xu_msg_alloc(offsetof(struct request, u) + reqlen);
+
+	memset(req, 0, offsetof(struct request, u));
+	return req;
 }
 
 static inline int __send_req(struct request *req, int qtype, uint32_t o, uint32_t h, int reqlen)
 {
-	int r;
 	struct header *hr;
+	struct request *head;
 
 	hr = &req->header;
 	hr->head = ((qtype & 0xff) << REQ_TYPE_SHIFT) | (reqlen & REQ_TYPE_MASK);
 	hr->owner    = o;
 	hr->fdesc    = h;
-	reqlen += sizeof *hr; /* add header */
-	r =  __write(_ioc->sendfd, req, reqlen);
-//	xu_error(NULL, "%s: %d, r = %d, type = %d", __func__, reqlen, r,  qtype);
-	assert(r == reqlen);
-	return (r - sizeof *hr);
+	head = ATOM_LOAD_ACQUIRE(&_ioc->reqs);
+	do {
+		req->next = head;
+	} while (!__atomic_compare_exchange_n(&_ioc->reqs, &head, req, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	/* the first one since the last drain wakes the IO thread */
+	if (head == NULL)
+		uv_async_send(&_ioc->wakeup);
+	return reqlen;
 }
 
-static void __on_req(uv_poll_t *uvp, int status, int events)
+static void __on_req(uv_async_t *as)
 {
-	struct io_context *ic;
-	struct request req;
-	int r, fd, size;
-
-	xu_io_gc();
-
-	if (uv_fileno((uv_handle_t *)uvp, &fd) != 0) {
-		xu_error(NULL, "can't get file handle");
-		return;
-	}
-	if (events & UV_READABLE) {
-		struct header *hr = &req.header;
-		ic = container_of(uvp, struct io_context, recvfd);
-		memset(&req, 0, sizeof req);
-		r = __read(fd, hr, sizeof *hr);
-		if (r < 0)
-			return;
-		assert(r == sizeof *hr);
-		size = hr->head & REQ_TYPE_MASK;
-		//xu_error(NULL, "r = %d, req_len = %d, type = %d, sizeof req.u = %d", r, size, type, sizeof req.u);
-		assert(size <= sizeof req.u);
-		if (size > 0) {
-			r = __read(fd, &req.u, size);
-			//xu_error(NULL, "r = %d, req.head.len = %d", r, size);
-			assert(r == size);
+	struct io_context *ic = container_of(as, struct io_context, wakeup);
+	struct request *req, *next, *fifo;
+
+	while ((req = __atomic_exchange_n(&ic->reqs, NULL, __ATOMIC_ACQUIRE)) != NULL) {
+		/* pushed newest first, handle them in order */
+		for (fifo = NULL; req; req = next) {
+			next = req->next;
+			req->next = fifo;
+			fifo = req;
+		}
+		for (req = fifo; req; req = next) {
+			next = req->next;
+			if (!__handle_req(ic, req))
+				__free_req(req);
 		}
-		__handle_req(ic, &req);
 	}
+	__flush_dirty(ic);
 }
 
 void xu_io_init(void)
 {
-	int pfd[2];
 	uv_loop_t *loop =uv_default_loop();
 
 	_ioc = xu_calloc(1, sizeof *_ioc);
 
 	SPIN_INIT(_ioc);
 
-	if (pipe(pfd) < 0) {
-		fprintf(stderr, "pipe failed.\n");
-		fflush(stderr);
-		abort();
-	}
-	_ioc->sendfd = pfd[1];
-
 	_ioc->handle_index = 1;
 
-	INIT_LIST_HEAD(&_ioc->io);
+	INIT_LIST_HEAD(&_ioc->dirty);
+	__index_grow(_ioc);
 
-	uv_poll_init(loop, &_ioc->recvfd, pfd[0]);
-	uv_poll_start(&_ioc->recvfd, UV_READABLE, __on_req);
+	uv_async_init(loop, &_ioc->wakeup, __on_req);
 }
 
 static uint32_t __io_host(uint32_t h, int e, const char *addr, int port, int proto)
 {
-	struct request req;
+	struct request *req;
 	struct req_host *sr;
-	uint16_t reqlen = sizeof *sr;
+	int reqlen = sizeof *sr + (addr ? strlen(addr) : 0) + 1;
 	uint32_t fdesc;
 
-	memset(&req, 0, sizeof req);
-	sr = &req.u.host;
-	if (addr) {
-		size_t len = strlen(addr);
-		size_t vlen = sizeof req.u - sizeof *sr;
-		if (len > vlen - 1) {
-			struct xu_actor *xa = xu_handle_ref(h);
-			xu_error(xa, "address %s too long.", addr);
-			if (xa)
-				xu_actor_unref(xa);
-			return -1;
-		}
-		len = xu_strlcpy(sr->host, addr, vlen);
-		reqlen += len;
-	}
+	req = __new_req(reqlen);
+	sr = &req->u.host;
+	sr->host[0] = '\0';
+	if (addr)
+		strcpy(sr->host, addr);
 	sr->protocol = proto;
 	sr->port  = port;
 	fdesc = __get_fdesc();
-	__send_req(&req, e, h, fdesc, reqlen);
+	__send_req(req, e, h, fdesc, reqlen);
 	return fdesc;
 }
 
@@ -933,166 +1303,175 @@ uint32_t xu_io_udp_server(uint32_t h, const char *addr, int port)
 
 int xu_io_write(uint32_t handle, uint32_t fdesc, const void *data, int len)
 {
-	struct request req;
+	struct request *req;
 	struct req_write *wr;
-	size_t reqlen = sizeof *wr;
+	int reqlen = sizeof *wr + len;
 
 	if (len <= 0) {
 		return -1;
 	}
 
-	wr = &req.u.write;
-	wr->len   = len;
-	if (len <= (sizeof req.u - sizeof *wr)) {
-		wr->data = req.u.buffer + sizeof *wr;
-		memcpy(wr->data, data, len);
-		reqlen += len;
-	} else {
-		wr->data = xu_malloc(len);
-		memcpy(wr->data, data, len);
-	}
-#if 0
-	{
-		struct xu_actor *ctx = xu_handle_ref(handle);
-		xu_error(ctx, "write: %d bytes", len);
-		xu_actor_unref(ctx);
+	req = __new_req(reqlen);
+	wr = &req->u.write;
+	wr->len  = len;
+	wr->data = wr + 1;
+	wr->owned = 0;
+	memcpy(wr->data, data, len);
+	return __send_req(req, IO_REQ_WRITE, handle, fdesc, reqlen) != reqlen;
+}
+
+int xu_io_write_owned(uint32_t handle, uint32_t fdesc, void *data, int len)
+{
+	struct request *req;
+	struct req_write *wr;
+	int reqlen = sizeof *wr;
+
+	if (len <= 0) {
+		xu_free(data);
+		return -1;
 	}
-#endif
-	return __send_req(&req, IO_REQ_WRITE, handle, fdesc, reqlen) != reqlen;
+
+	req = __new_req(reqlen);
+	wr = &req->u.write;
+	wr->len   = len;
+	wr->data  = data;
+	wr->owned = 1;
+	return __send_req(req, IO_REQ_WRITE, handle, fdesc, reqlen) != reqlen;
 }
 
 int xu_io_udp_send(uint32_t handle, uint32_t fdesc, union sockaddr_all *addr, const void *data, int len)
 {
-	struct request   req;
+	struct request   *req;
 	struct req_usend *ur;
-	int reqlen =  sizeof *ur;
+	int reqlen =  sizeof *ur + len;
 
-	ur = &req.u.usend;
+	req = __new_req(reqlen);
+	ur = &req->u.usend;
 	ur->addr = *addr;
 	ur->len = len;
-	if (len <= sizeof req.u - reqlen) {
-		ur->data = req.u.buffer + reqlen;
-		memcpy(ur->data, data, len);
-		reqlen += len;
-	} else {
-		ur->data = xu_malloc(len);
-		memcpy(ur->data, data, len);
-	}
+	ur->data = ur + 1;
+	ur->owned = 0;
+	memcpy(ur->data, data, len);
+
+	return __send_req(req, IO_REQ_UDPSEND, handle, fdesc, reqlen) != reqlen;
+}
 
-	return __send_req(&req, IO_REQ_UDPSEND, handle, fdesc, reqlen) != reqlen;
+int xu_io_udp_send_owned(uint32_t handle, uint32_t fdesc, union sockaddr_all *addr, void *data, int len)
+{
+	struct request   *req;
+	struct req_usend *ur;
+	int reqlen = sizeof *ur;
+
+	req = __new_req(reqlen);
+	ur = &req->u.usend;
+	ur->addr  = *addr;
+	ur->len   = len;
+	ur->data  = data;
+	ur->owned = 1;
+	return __send_req(req, IO_REQ_UDPSEND, handle, fdesc, reqlen) != reqlen;
 }
 
 uint32_t xu_io_udp_open(uint32_t handle, int udp6)
 {
-	struct request req;
-	struct req_uopen *ru;
+	struct request *req = __new_req(sizeof (struct req_uopen));
 	uint32_t fdesc;
 
-	ru = &req.u.uopen;
-	ru->udp6 = udp6;
+	req->u.uopen.udp6 = udp6;
 	fdesc = __get_fdesc();
-	__send_req(&req, IO_REQ_UOPEN, handle, fdesc, sizeof *ru);
+	__send_req(req, IO_REQ_UOPEN, handle, fdesc, sizeof req->u.uopen);
 
 	return fdesc;
 }
 
 uint32_t xu_io_fd_open(uint32_t handle, int fd)
 {
-	struct request req;
+	struct request *req = __new_req(sizeof req->u.reserved);
 	uint32_t h;
 
 	h = __get_fdesc();
-	req.u.reserved = fd;
-	__send_req(&req, IO_REQ_POLLFD, handle, h, sizeof req.u.reserved);
+	req->u.reserved = fd;
+	__send_req(req, IO_REQ_POLLFD, handle, h, sizeof req->u.reserved);
 
 	return h;
 }
 
 int xu_io_udp_membership(uint32_t handle, uint32_t fdesc, const char *mcast, const char *iaddr, int join)
 {
-	struct request req;
-	struct req_membership *rm = &req.u.membership;
+	struct request *req = __new_req(sizeof (struct req_membership));
+	struct req_membership *rm = &req->u.membership;
 
 	rm->mlen = xu_strlcpy(rm->maddr, mcast, sizeof rm->maddr);
 	rm->ilen = xu_strlcpy(rm->iaddr, iaddr, sizeof rm->iaddr);
 	rm->join = join;
 
-	return __send_req(&req, IO_REQ_MEMBERSHIP, handle, fdesc, sizeof *rm) != sizeof *rm;
+	return __send_req(req, IO_REQ_MEMBERSHIP, handle, fdesc, sizeof *rm) != sizeof *rm;
 }
 
-int xu_io_udp_set_multicast_loop(uint32_t handle, uint32_t fdesc, int on)
+static int __set_flag(uint32_t handle, uint32_t fdesc, int flag, int how, int reserved)
 {
-	struct request req;
-	struct req_flags *rf = &req.u.flags;
+	struct request *req = __new_req(sizeof (struct req_flags));
+	struct req_flags *rf = &req->u.flags;
 
-	rf->flag = REQ_FLAGS_MCAST_LOOP;
-	rf->how = on;
+	rf->flag = flag;
+	rf->how = how;
+	rf->reserved = reserved;
 
-	return __send_req(&req, IO_REQ_FLAGS, handle, fdesc, sizeof *rf) != sizeof *rf;
+	return __send_req(req, IO_REQ_FLAGS, handle, fdesc, sizeof *rf) != sizeof *rf;
 }
 
-int xu_io_udp_set_broadcast(uint32_t handle, uint32_t fdesc, int on)
+int xu_io_udp_set_multicast_loop(uint32_t handle, uint32_t fdesc, int on)
 {
-	struct request req;
-	struct req_flags *rf = &req.u.flags;
-
-	rf->flag = REQ_FLAGS_BROADCAST;
-	rf->how = on;
+	return __set_flag(handle, fdesc, REQ_FLAGS_MCAST_LOOP, on, 0);
+}
 
-	return __send_req(&req, IO_REQ_FLAGS, handle, fdesc, sizeof *rf) != sizeof *rf;
+int xu_io_udp_set_broadcast(uint32_t handle, uint32_t fdesc, int on)
+{
+	return __set_flag(handle, fdesc, REQ_FLAGS_BROADCAST, on, 0);
 }
 
 int xu_io_udp_set_ttl(uint32_t handle, uint32_t fdesc, int on)
 {
-	struct request req;
-	struct req_flags *rf = &req.u.flags;
-
-	rf->flag = REQ_FLAGS_UDP_TTL;
-	rf->how = on;
-
-	return __send_req(&req, IO_REQ_FLAGS, handle, fdesc, sizeof *rf) != sizeof *rf;
+	return __set_flag(handle, fdesc, REQ_FLAGS_UDP_TTL, on, 0);
 }
 
 int xu_io_udp_set_multicast_ttl(uint32_t handle, uint32_t fdesc, int on)
 {
-	struct request req;
-	struct req_flags *rf = &req.u.flags;
-
-	rf->flag = REQ_FLAGS_UDP_MCAST_TTL;
-	rf->how = on;
-
-	return __send_req(&req, IO_REQ_FLAGS, handle, fdesc, sizeof *rf) != sizeof *rf;
+	return __set_flag(handle, fdesc, REQ_FLAGS_UDP_MCAST_TTL, on, 0);
 }
 
 int xu_io_tcp_nodelay(uint32_t handle, uint32_t fdesc, int on)
 {
-	struct request req;
-	struct req_flags *rf = &req.u.flags;
-
-	rf->flag = REQ_FLAGS_TCP_NODELAY;
-	rf->how = on;
-
-	return __send_req(&req, IO_REQ_FLAGS, handle, fdesc, sizeof *rf) != sizeof *rf;
+	return __set_flag(handle, fdesc, REQ_FLAGS_TCP_NODELAY, on, 0);
 }
 
 int xu_io_tcp_keepalive(uint32_t handle, uint32_t fdesc, int enable, int delay)
 {
-	struct request req;
-	struct req_flags *rf = &req.u.flags;
+	return __set_flag(handle, fdesc, REQ_FLAGS_TCP_KEEPALIVE, enable, delay);
+}
 
-	rf->flag = REQ_FLAGS_TCP_KEEPALIVE;
-	rf->how = enable;
-	rf->reserved = delay;
+int xu_io_tcp_cork(uint32_t handle, uint32_t fdesc, int on)
+{
+	return __set_flag(handle, fdesc, REQ_FLAGS_TCP_CORK, on, 0);
+}
 
-	return __send_req(&req, IO_REQ_FLAGS, handle, fdesc, sizeof *rf) != sizeof *rf;
+int xu_io_udp_set_batch(uint32_t handle, uint32_t fdesc, int dgram_max)
+{
+	return __set_flag(handle, fdesc, REQ_FLAGS_UDP_BATCH, dgram_max, 0);
+}
+
+void xu_io_owner_exit(uint32_t handle)
+{
+	/* no IO layer, in the benchmarks */
+	if (_ioc == NULL)
+		return;
+	__send_req(__new_req(0), IO_REQ_OWNER_EXIT, handle, 0, 0);
 }
 
 int xu_io_close(uint32_t handle, uint32_t fdesc)
 {
-	struct request req;
+	struct request *req = __new_req(0);
 
-	__send_req(&req, IO_REQ_CLOSE, handle, fdesc, 0);
+	__send_req(req, IO_REQ_CLOSE, handle, fdesc, 0);
 
 	return 0;
 }
-
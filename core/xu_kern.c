@@ -35,23 +35,58 @@ struct xu_actor {
 	FILE *logfile;
 
 	struct queue *q;
+
+	int timer_batch;
+};
+
+/*
+ * Actor mailbox: a lock-free multi-producer/single-consumer queue made of
+ * fixed size segments.  Producers claim a slot with an atomic increment on
+ * the tail segment and link a new segment when it is full, the owner of
+ * the queue (the worker dispatching it) consumes from the head segment.
+ */
+#define MQ_SEGMENT_SIZE (64)
+
+struct mq_slot {
+	struct xu_msg msg;
+	int ready;
+};
+
+struct mq_segment {
+	struct mq_segment *next;
+	struct mq_segment *rnext; /* retired list */
+	uint32_t base;            /* sequence number of slots[0] */
+	int reserve;              /* slots claimed by producers */
+	struct mq_slot slots[MQ_SEGMENT_SIZE];
 };
 
 struct queue {
 	struct queue *next;
 
-	int cap;
-	int head;
-	int tail;
-	struct xu_msg *msgs;
-
-	struct spinlock lock;
+	/* consumer side */
+	struct mq_segment *head;
+	int head_idx;
+	struct mq_segment *retired;
 
 	uint32_t handle;
 
 	int in_global;
 
 	int drop;
+
+	uint32_t consumed;        /* sequence number of the next message */
+
+	/* limits, cap == 0: unbounded */
+	int cap;
+	int policy;
+	uint32_t supervisor;
+	int overload;             /* overload reported, not drained yet */
+	int shed;                 /* oldest messages to discard */
+
+	/* producer side */
+	struct mq_segment *tail __attribute__((aligned(64)));
+	struct mq_segment *spare;
+	int writers;
 };
 
 struct module_mgr {
@@ -205,54 +240,211 @@ struct queue_mgr {
 
 static struct queue_mgr _Q[1];
 
-/* actor */
+/*
+ * Work-stealing scheduler: every worker owns a run queue of runnable
+ * mailboxes, the global list only takes overflow and queues made
+ * runnable by non worker threads (io, timer).
+ */
+#define RUNQ_SIZE        (256)
+#define RUNQ_GLOBAL_TICK (61) /* poll the global list every n pops */
+
+struct runq {
+	struct spinlock lock;
+	unsigned int head;
+	unsigned int tail;
+	struct queue *q[RUNQ_SIZE];
+} __attribute__((aligned(64)));
+
+struct sched_mgr {
+	int mode;
+	int workers;
+	struct runq *rq;
+};
+
+static struct sched_mgr _S[1];
+
+static __thread int __worker = -1;
+static __thread unsigned int __tick = 0;
+
+/*
+ * actor
+ *
+ * Readers walk the handle table without locking, inside an epoch (see
+ * xu_epoch.c): a resize publishes a new table and the old one, like a
+ * dead actor, is released once no reader can still see it.  Writers
+ * serialize on the spinlock.
+ */
+struct handle_table {
+	int size;
+	struct xu_actor *slot[1];
+};
+
+/*
+ * Name registry, a chained hash table read the same way.  Several actors
+ * may share a name, lookups find the last one named.  `gen' changes with
+ * every update, callers caching a resolved name compare it.
+ */
+struct name_entry {
+	struct name_entry *next;
+	uint32_t hash;
+	uint32_t handle;
+	char name[XU_NAME_LEN + 1];
+};
+
+struct name_table {
+	int size;
+	int count;
+	struct name_entry *bucket[1];
+};
+
 struct actor_mgr {
-	struct rwlock lock;
+	struct spinlock lock;
 
 	uint32_t handle_index;
 
 	struct queue *q;
 
-	int slot_size;
-	struct xu_actor **slot;
+	struct handle_table *tab;
+
+	struct name_table *names;
+	uint32_t gen;
 };
 
 static struct actor_mgr *_am = NULL;
 
+static uint32_t __name_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct name_table *__names_new(int size)
+{
+	struct name_table *t;
+
+	t = xu_calloc(1, sizeof *t + (size - 1) * sizeof t->bucket[0]);
+	t->size = size;
+	return t;
+}
+
+static void __names_free(void *p)
+{
+	struct name_table *t = p;
+	struct name_entry *e, *next;
+	int i;
+
+	for (i = 0; i < t->size; ++i) {
+		for (e = t->bucket[i]; e; e = next) {
+			next = e->next;
+			xu_free(e);
+		}
+	}
+	xu_free(t);
+}
+
+/* _am locked */
+static void __names_insert(const char *name, uint32_t handle)
+{
+	struct name_table *t = _am->names, *nt;
+	struct name_entry *e, *ne, **it;
+	int i;
+
+	if (t->count >= t->size * 2) {
+		/* copy to a larger table, readers may still walk the old one */
+		nt = __names_new(t->size * 2);
+		for (i = 0; i < t->size; ++i) {
+			for (e = t->bucket[i]; e; e = e->next) {
+				ne = xu_malloc(sizeof *ne);
+				*ne = *e;
+				ne->next = NULL;
+				/* keep the order, the last named first */
+				for (it = &nt->bucket[ne->hash & (nt->size - 1)]; *it; it = &(*it)->next)
+					;
+				*it = ne;
+			}
+		}
+		nt->count = t->count;
+		ATOM_STORE_RELEASE(&_am->names, nt);
+		xu_epoch_defer(t, __names_free);
+		t = nt;
+	}
+	e = xu_malloc(sizeof *e);
+	e->hash = __name_hash(name);
+	e->handle = handle;
+	xu_strlcpy(e->name, name, sizeof e->name);
+	e->next = t->bucket[e->hash & (t->size - 1)];
+	ATOM_STORE_RELEASE(&t->bucket[e->hash & (t->size - 1)], e);
+	t->count++;
+	ATOM_INC(&_am->gen);
+}
+
+/* _am locked */
+static void __names_remove(const char *name, uint32_t handle)
+{
+	struct name_table *t = _am->names;
+	struct name_entry *e, **it;
+	uint32_t hash = __name_hash(name);
+
+	for (it = &t->bucket[hash & (t->size - 1)]; (e = *it) != NULL; it = &e->next) {
+		if (e->handle == handle && e->hash == hash && strcmp(e->name, name) == 0) {
+			ATOM_STORE_RELEASE(it, e->next);
+			t->count--;
+			ATOM_INC(&_am->gen);
+			xu_epoch_defer(e, xu_free);
+			return;
+		}
+	}
+}
+
+static struct handle_table *__table_new(int size)
+{
+	struct handle_table *t;
+
+	t = xu_calloc(1, sizeof *t + (size - 1) * sizeof t->slot[0]);
+	t->size = size;
+	return t;
+}
+
 static void xu_actors_init(void)
 {
 	_am = xu_calloc(1, sizeof *_am);
-	rwlock_init(&_am->lock);
+	SPIN_INIT(_am);
 	_am->handle_index = 1;
-	_am->slot_size = 4;
-	_am->slot = xu_malloc(_am->slot_size * sizeof _am->slot[0]);
+	_am->tab = __table_new(4);
+	_am->names = __names_new(16);
 }
 
 static uint32_t xu_actor_register(struct xu_actor *xa)
 {
-	rwlock_wlock(&_am->lock);
+	SPIN_LOCK(_am);
 	for (;;) {
+		struct handle_table *t = _am->tab, *nt;
 		int i;
-		for (i = 0; i < _am->slot_size; ++i) {
+		for (i = 0; i < t->size; ++i) {
 			uint32_t handle = (i + _am->handle_index) & 0xffffff;
-			int hash = handle & (_am->slot_size - 1);
-			if (_am->slot[hash] == NULL) {
-				_am->slot[hash] = xa;
+			int hash = handle & (t->size - 1);
+			if (t->slot[hash] == NULL) {
+				xa->handle = handle;
+				ATOM_STORE_RELEASE(&t->slot[hash], xa);
 				_am->handle_index = handle + 1;
-				rwlock_wunlock(&_am->lock);
+				SPIN_UNLOCK(_am);
 				return handle;
 			}
 		}
-		assert((_am->slot_size * 2 - 1) <= 0xffffff);
-		struct xu_actor **new_slot = xu_calloc(_am->slot_size * 2, sizeof _am->slot[0]);
-		for (i = 0; i < _am->slot_size; ++i) {
-			int hash = (_am->slot[i])->handle & (_am->slot_size * 2 - 1);
-			assert(new_slot[hash] == NULL);
-			new_slot[hash] = _am->slot[i];
+		assert((t->size * 2 - 1) <= 0xffffff);
+		nt = __table_new(t->size * 2);
+		for (i = 0; i < t->size; ++i) {
+			int hash = (t->slot[i])->handle & (nt->size - 1);
+			assert(nt->slot[hash] == NULL);
+			nt->slot[hash] = t->slot[i];
 		}
-		xu_free(_am->slot);
-		_am->slot = new_slot;
-		_am->slot_size *= 2;
+		ATOM_STORE_RELEASE(&_am->tab, nt);
+		xu_epoch_defer(t, xu_free);
 	}
 }
 
@@ -261,24 +453,39 @@ int xu_handle_retire(uint32_t handle)
 	int r = 0;
 	struct actor_mgr *s = _am;
 
-	rwlock_wlock(&s->lock);
-	uint32_t hash = handle & (s->slot_size - 1);
-	struct xu_actor *ctx = s->slot[hash];
+	SPIN_LOCK(s);
+	struct handle_table *t = s->tab;
+	uint32_t hash = handle & (t->size - 1);
+	struct xu_actor *ctx = t->slot[hash];
 
 	if (ctx != NULL && ctx->handle == handle) {
-		s->slot[hash] = NULL;
+		ATOM_STORE_RELEASE(&t->slot[hash], NULL);
+		if (ctx->name[0] != '\0')
+			__names_remove(ctx->name, handle);
 		r = 1;
 	} else {
 		ctx = NULL;
 	}
-	rwlock_wunlock(&s->lock);
+	SPIN_UNLOCK(s);
 	if (ctx) {
 		xu_actor_unref(ctx);
 	}
 	return r;
 }
 
-void xu_queue_push(struct queue *q)
+/* take a reference unless the actor is already dying */
+static inline struct xu_actor *__actor_tryref(struct xu_actor *ctx)
+{
+	int ref;
+
+	do {
+		if ((ref = ctx->ref) == 0)
+			return NULL;
+	} while (!ATOM_CAS(&ctx->ref, ref, ref + 1));
+	return ctx;
+}
+
+static void __global_push(struct queue *q)
 {
 	SPIN_LOCK(_Q);
 	assert(q->next == NULL);
@@ -291,10 +498,14 @@ void xu_queue_push(struct queue *q)
 	SPIN_UNLOCK(_Q);
 }
 
-struct queue *xu_queue_pop()
+static struct queue *__global_pop(void)
 {
+	struct queue *q;
+
+	if (_Q->head == NULL) /* don't touch the lock if empty */
+		return NULL;
 	SPIN_LOCK(_Q);
-	struct queue *q = _Q->head;
+	q = _Q->head;
 	if (q) {
 		_Q->head = q->next;
 		if (_Q->head == NULL) {
@@ -307,125 +518,414 @@ struct queue *xu_queue_pop()
 	return q;
 }
 
-static struct queue *xu_queue_new(uint32_t h)
+static int runq_push(struct runq *rq, struct queue *q)
 {
-	struct queue *q = xu_malloc(sizeof *q);
+	int r = 0;
 
-	q->handle = h;
-	q->cap = 64;
-	q->head = 0;
-	q->tail = 0;
+	SPIN_LOCK(rq);
+	if (rq->tail - rq->head < RUNQ_SIZE) {
+		rq->q[rq->tail++ % RUNQ_SIZE] = q;
+		r = 1;
+	}
+	SPIN_UNLOCK(rq);
+	return r;
+}
 
-	SPIN_INIT(q);
-	q->in_global = 1;
-	q->drop = 0;
-	q->msgs = xu_calloc(q->cap, sizeof q->msgs[0]);
-	q->next = NULL;
+static struct queue *runq_pop(struct runq *rq)
+{
+	struct queue *q = NULL;
 
+	if (rq->tail == rq->head)
+		return NULL;
+	SPIN_LOCK(rq);
+	if (rq->tail != rq->head) {
+		q = rq->q[rq->head++ % RUNQ_SIZE];
+	}
+	SPIN_UNLOCK(rq);
 	return q;
 }
 
-static void expand_q(struct queue *q)
+/*
+ * Steal half of the victim's run queue: return the first one, put the
+ * others in our own run queue.
+ */
+static struct queue *runq_steal(struct runq *self, struct runq *victim)
+{
+	struct queue *q[RUNQ_SIZE / 2];
+	unsigned int i, n;
+
+	if (victim->tail == victim->head)
+		return NULL;
+	if (!spinlock_trylock(&victim->lock))
+		return NULL;
+	n = (victim->tail - victim->head + 1) / 2;
+	if (n > RUNQ_SIZE / 2)
+		n = RUNQ_SIZE / 2;
+	for (i = 0; i < n; ++i) {
+		q[i] = victim->q[victim->head++ % RUNQ_SIZE];
+	}
+	SPIN_UNLOCK(victim);
+
+	for (i = 1; i < n; ++i) {
+		if (!runq_push(self, q[i]))
+			__global_push(q[i]);
+	}
+	return n > 0 ? q[0] : NULL;
+}
+
+void xu_sched_init(int workers, int steal)
 {
-	struct xu_msg *nq = xu_calloc(q->cap * 2, sizeof *nq);
 	int i;
 
-	for (i = 0; i < q->cap; ++i) {
-		nq[i] = q->msgs[(q->head + i) % q->cap];
+	_S->mode = steal ? XU_SCHED_STEAL : XU_SCHED_GLOBAL;
+	_S->workers = workers;
+	if (_S->mode == XU_SCHED_STEAL) {
+		_S->rq = xu_calloc(workers, sizeof _S->rq[0]);
+		for (i = 0; i < workers; ++i) {
+			SPIN_INIT(&_S->rq[i]);
+		}
 	}
-	q->head = 0;
-	q->tail = q->cap;
-	q->cap *= 2;
-	xu_free(q->msgs);
-	q->msgs = nq;
 }
 
-static void xu_queue_put(struct queue *q, struct xu_msg *msg)
+void xu_sched_worker(int id)
+{
+	__worker = id;
+}
+
+void xu_queue_push(struct queue *q)
 {
-	SPIN_LOCK(q);
-	q->msgs[q->tail] = *msg;
-	if (++q->tail >= q->cap) {
-		q->tail = 0;
+	if (_S->mode != XU_SCHED_STEAL || __worker < 0 || !runq_push(&_S->rq[__worker], q)) {
+		__global_push(q);
 	}
+	xu_worker_wakeup();
+}
 
-	if (q->head == q->tail) {
-		expand_q(q);
+struct queue *xu_queue_pop()
+{
+	struct runq *self;
+	struct queue *q;
+	int i, n;
+
+	if (_S->mode != XU_SCHED_STEAL || __worker < 0)
+		return __global_pop();
+
+	self = &_S->rq[__worker];
+	/* don't starve the global list */
+	if ((++__tick % RUNQ_GLOBAL_TICK) == 0 && (q = __global_pop()) != NULL)
+		return q;
+	if ((q = runq_pop(self)) != NULL)
+		return q;
+	if ((q = __global_pop()) != NULL)
+		return q;
+
+	n = _S->workers;
+	for (i = 1; i < n; ++i) {
+		if ((q = runq_steal(self, &_S->rq[(__worker + i) % n])) != NULL)
+			return q;
 	}
+	return NULL;
+}
 
-	if (q->in_global == 0) {
-		q->in_global = 1;
-		xu_queue_push(q);
+static struct mq_segment *mq_segment_new(struct queue *q, uint32_t base)
+{
+	struct mq_segment *seg = q->spare;
+
+	if (seg && ATOM_CAS_POINTER(&q->spare, seg, NULL)) {
+		memset(seg, 0, sizeof *seg);
+	} else {
+		seg = xu_calloc(1, sizeof *seg);
 	}
-	SPIN_UNLOCK(q);
+	seg->base = base;
+
+	return seg;
 }
 
-int xu_queue_get(struct queue *q, struct xu_msg *msg)
+static void mq_segment_free(struct queue *q, struct mq_segment *seg)
+{
+	if (q->spare != NULL || !ATOM_CAS_POINTER(&q->spare, NULL, seg)) {
+		xu_free(seg);
+	}
+}
+
+/*
+ * Release consumed segments once no producer can still hold a pointer
+ * to them: a producer announces itself in `writers' before it reads the
+ * tail, and moves the tail forward before it leaves.
+ */
+static void mq_reclaim(struct queue *q)
+{
+	struct mq_segment *seg, *next;
+
+	if (q->retired == NULL)
+		return;
+	__sync_synchronize();
+	if (q->writers != 0)
+		return;
+	seg = q->retired;
+	q->retired = NULL;
+	while (seg) {
+		next = seg->rnext;
+		mq_segment_free(q, seg);
+		seg = next;
+	}
+}
+
+/*
+ * Return the next ready slot of the consumer, or NULL if the queue
+ * is empty (or the next producer has not finished writing yet).
+ */
+static struct mq_slot *mq_peek(struct queue *q)
+{
+	struct mq_segment *seg = q->head;
+	struct mq_slot *slot;
+
+	if (q->head_idx == MQ_SEGMENT_SIZE) {
+		if (seg->next == NULL)
+			return NULL;
+		q->head = seg->next;
+		q->head_idx = 0;
+		seg->rnext = q->retired;
+		q->retired = seg;
+		mq_reclaim(q);
+		seg = q->head;
+	}
+	slot = &seg->slots[q->head_idx];
+	if (!ATOM_LOAD_ACQUIRE(&slot->ready))
+		return NULL;
+	return slot;
+}
+
+static inline void __msg_release(struct xu_msg *msg)
+{
+	if (msg->size > 0 && !(msg->size & MSIZE_INLINE))
+		xu_msg_free((void *)msg->data);
+}
+
+/* copy the header, and the payload only if it is inline */
+static inline void mq_copy(struct xu_msg *dst, const struct xu_msg *src)
+{
+	size_t n = offsetof(struct xu_msg, inl);
+
+	if (src->size & MSIZE_INLINE)
+		n += src->size & ~MSIZE_INLINE;
+	memcpy(dst, src, n);
+}
+
+static int mq_pop(struct queue *q, struct xu_msg *msgs, int n)
+{
+	struct mq_slot *slot;
+	int i = 0;
+
+	while (i < n && (slot = mq_peek(q)) != NULL) {
+		mq_copy(&msgs[i++], &slot->msg);
+		++q->head_idx;
+	}
+	if (i > 0)
+		q->consumed = q->head->base + q->head_idx;
+	return i;
+}
+
+/* discard the messages producers asked to shed (drop-oldest) */
+static void mq_shed(struct queue *q)
+{
+	struct xu_msg msg;
+
+	while (q->shed > 0 && mq_pop(q, &msg, 1)) {
+		__msg_release(&msg);
+		ATOM_DEC(&q->shed);
+	}
+}
+
+/*
+ * Check the mailbox limit, called by a producer between announcing
+ * itself in `writers' and reserving its slot.  The length is only
+ * approximate, the limit is a soft one.
+ */
+static int mq_admit(struct queue *q)
+{
+	struct mq_segment *tail = q->tail;
+	int reserve = tail->reserve;
+
+	if (reserve > MQ_SEGMENT_SIZE)
+		reserve = MQ_SEGMENT_SIZE;
+	if ((tail->base + reserve) - q->consumed < (uint32_t)q->cap)
+		return MQ_OK;
+
+	switch (q->policy) {
+	case XU_MAILBOX_DROP_OLDEST:
+		ATOM_INC(&q->shed);
+		return MQ_SHED;
+	case XU_MAILBOX_DROP_NEWEST:
+		return MQ_DROPPED;
+	default:
+		return MQ_FULL;
+	}
+}
+
+struct queue *xu_queue_new(uint32_t h)
+{
+	struct queue *q = xu_malloc(sizeof *q);
+
+	q->handle = h;
+	q->in_global = 1;
+	q->drop = 0;
+	q->next = NULL;
+
+	q->head = q->tail = xu_calloc(1, sizeof *q->head);
+	q->head_idx = 0;
+	q->retired = NULL;
+	q->spare = NULL;
+	q->writers = 0;
+	q->consumed = 0;
+	q->cap = 0;
+	q->policy = XU_MAILBOX_REJECT;
+	q->supervisor = 0;
+	q->overload = 0;
+	q->shed = 0;
+
+	return q;
+}
+
+void xu_queue_limit(struct queue *q, int cap, int policy, uint32_t supervisor)
 {
-	int ret = 0;
+	q->policy = policy;
+	q->supervisor = supervisor;
+	q->cap = cap > 0 ? cap : 0;
+}
 
-	SPIN_LOCK(q);
-	if (q->head != q->tail) {
-		*msg = q->msgs[q->head++];
-		if (q->head >= q->cap) {
-			q->head = 0;
+int xu_queue_put(struct queue *q, struct xu_msg *msg)
+{
+	struct mq_segment *seg, *next;
+	int idx, r = MQ_OK;
+
+	ATOM_INC(&q->writers);
+	if (q->cap > 0 && (r = mq_admit(q)) != MQ_OK && r != MQ_SHED) {
+		ATOM_DEC(&q->writers);
+		return r;
+	}
+	for (;;) {
+		seg = q->tail;
+		idx = ATOM_FINC(&seg->reserve);
+		if (idx < MQ_SEGMENT_SIZE)
+			break;
+		/* segment full, link (or help to link) the next one */
+		if ((next = seg->next) == NULL) {
+			next = mq_segment_new(q, seg->base + MQ_SEGMENT_SIZE);
+			if (!ATOM_CAS_POINTER(&seg->next, NULL, next)) {
+				mq_segment_free(q, next);
+				next = seg->next;
+			}
 		}
-	} else {
-		ret = 1;
+		ATOM_CAS_POINTER(&q->tail, seg, next);
 	}
-	if (ret)
-		q->in_global = 0;
-	SPIN_UNLOCK(q);
-	return ret;
+	mq_copy(&seg->slots[idx].msg, msg);
+	ATOM_STORE_RELEASE(&seg->slots[idx].ready, 1);
+	ATOM_DEC(&q->writers);
+
+	if (q->in_global == 0 && ATOM_CAS(&q->in_global, 0, 1)) {
+		xu_queue_push(q);
+	}
+	return r;
+}
+
+int xu_queue_get_batch(struct queue *q, struct xu_msg *msgs, int n)
+{
+	int r;
+
+	if (q->shed > 0)
+		mq_shed(q);
+	r = mq_pop(q, msgs, n);
+	/* drained below half of the limit, report the next overload again */
+	if (q->overload && xu_queue_length(q) <= q->cap / 2)
+		q->overload = 0;
+	if (r > 0)
+		return r;
+
+	/*
+	 * Looks empty: leave the global queue, then check again, a producer
+	 * which missed `in_global' going to 0 would not push us back.
+	 */
+	q->in_global = 0;
+	__sync_synchronize();
+	if (mq_peek(q) != NULL && ATOM_CAS(&q->in_global, 0, 1)) {
+		return mq_pop(q, msgs, n);
+	}
+	mq_reclaim(q);
+	return 0;
+}
+
+int xu_queue_get(struct queue *q, struct xu_msg *msg)
+{
+	return xu_queue_get_batch(q, msg, 1) == 0;
 }
 
 static void __drop_q(struct queue *q)
 {
+	struct mq_segment *seg, *next;
 	struct xu_msg msg;
 
-	while (!xu_queue_get(q, &msg)) {
-		if (msg.size > 0)
-			xu_free((void *)msg.data);
+	while (mq_pop(q, &msg, 1)) {
+		__msg_release(&msg);
+	}
+	for (seg = q->head; seg; seg = next) {
+		next = seg->next;
+		xu_free(seg);
 	}
-	SPIN_RELEASE(q);
-	xu_free(q->msgs);
+	for (seg = q->retired; seg; seg = next) {
+		next = seg->rnext;
+		xu_free(seg);
+	}
+	xu_free(q->spare);
 	xu_free(q);
 }
 
 void xu_queue_free(struct queue *q)
 {
-	SPIN_LOCK(q);
-
 	if (q->drop) {
-		SPIN_UNLOCK(q);
 		__drop_q(q);
 	} else {
 		xu_queue_push(q);
-		SPIN_UNLOCK(q);
 	}
 }
 
 uint32_t xu_queue_length(struct queue *q)
 {
-	int head, tail, cap;
-	SPIN_LOCK(q);
-	head = q->head;
-	tail = q->tail;
-	cap = q->cap;
-	SPIN_UNLOCK(q);
+	struct mq_segment *tail = q->tail;
+	int reserve = tail->reserve;
 
-	if (head <= tail) {
-		return tail - head;
-	}
-	return tail + cap - head;
+	if (reserve > MQ_SEGMENT_SIZE)
+		reserve = MQ_SEGMENT_SIZE;
+
+	return (tail->base + reserve) - (q->head->base + q->head_idx);
 }
 
 void xu_queue_mark_drop(struct queue *q)
 {
-	SPIN_LOCK(q);
 	assert(q->drop == 0);
-	if (!q->in_global)
+	q->drop = 1;
+	__sync_synchronize();
+	if (q->in_global == 0 && ATOM_CAS(&q->in_global, 0, 1))
 		xu_queue_push(q);
-	SPIN_UNLOCK(q);
+}
+
+/* actors asking for batched timeouts */
+static int _timer_batch = 0;
+
+void xu_actor_batch_timeouts(struct xu_actor *ctx, int on)
+{
+	on = !!on;
+	if (ATOM_CAS(&ctx->timer_batch, !on, on))
+		ATOM_ADD(&_timer_batch, on ? 1 : -1);
+}
+
+int xu_actor_timerbatch(struct xu_actor *ctx)
+{
+	return ctx->timer_batch;
+}
+
+int xu_timerbatch_actors(void)
+{
+	return _timer_batch;
 }
 
 struct xu_actor *xu_actor_unref(struct xu_actor *ctx)
@@ -435,7 +935,11 @@ struct xu_actor *xu_actor_unref(struct xu_actor *ctx)
 			fclose(ctx->logfile);
 		ctx->module->free(ctx->instance);
 		xu_queue_mark_drop(ctx->q);
-		xu_free(ctx);
+		xu_io_owner_exit(ctx->handle);
+		if (ctx->timer_batch)
+			ATOM_DEC(&_timer_batch);
+		/* lock-free readers may still hold the pointer */
+		xu_epoch_defer(ctx, xu_free);
 		__actors_dec();
 		return NULL;
 	}
@@ -468,6 +972,54 @@ void xu_actor_logoff(struct xu_actor *ctx)
 	}
 }
 
+int xu_mailbox_policy(const char *s)
+{
+	if (strcmp(s, "drop-newest") == 0)
+		return XU_MAILBOX_DROP_NEWEST;
+	if (strcmp(s, "drop-oldest") == 0)
+		return XU_MAILBOX_DROP_OLDEST;
+	if (strcmp(s, "reject") == 0)
+		return XU_MAILBOX_REJECT;
+	return -1;
+}
+
+/*
+ * Mailbox limit of a new actor: env `mailbox.<module>', or `mailbox',
+ * formatted as "capacity[,policy]".
+ */
+static void __mailbox_conf(struct queue *q, const char *module)
+{
+	char key[XU_NAME_LEN + 16], buf[64] = {0};
+	char *args = buf, *p;
+	int cap, policy = XU_MAILBOX_REJECT;
+
+	snprintf(key, sizeof key, "mailbox.%s", module);
+	if (xu_getenv(key, buf, sizeof buf) == NULL &&
+	    xu_getenv("mailbox", buf, sizeof buf) == NULL)
+		return;
+	p = strsep(&args, ", \t");
+	if ((cap = atoi(p)) <= 0)
+		return;
+	while ((p = strsep(&args, ", \t")) != NULL && *p == '\0')
+		;
+	if (p && (policy = xu_mailbox_policy(p)) < 0) {
+		xu_error(NULL, "unknown mailbox policy %s", p);
+		policy = XU_MAILBOX_REJECT;
+	}
+	xu_queue_limit(q, cap, policy, 0);
+}
+
+int xu_actor_mailbox(uint32_t handle, int cap, int policy, uint32_t supervisor)
+{
+	struct xu_actor *ctx = xu_handle_ref(handle);
+
+	if (ctx == NULL)
+		return -1;
+	xu_queue_limit(ctx->q, cap, policy, supervisor);
+	xu_actor_unref(ctx);
+	return 0;
+}
+
 struct xu_actor *xu_actor_new(const char *name, const char *p)
 {
 	struct xu_module *m;
@@ -492,6 +1044,7 @@ struct xu_actor *xu_actor_new(const char *name, const char *p)
 	xa->ref = 2;
 	xa->handle = xu_actor_register(xa);
 	struct queue *q = xa->q = xu_queue_new(xa->handle);
+	__mailbox_conf(q, name);
 
 	__actors_inc();
 
@@ -512,55 +1065,65 @@ struct xu_actor *xu_actor_new(const char *name, const char *p)
 
 void xu_actors_foreach(void *ud, int (*f)(void *ud, struct xu_actor *))
 {
+	struct handle_table *t;
 	struct xu_actor *ctx;
-	int i = 0, n;
-
-	rwlock_rlock(&_am->lock);
-	n = _am->slot_size;
-	while (i < n) {
-		ctx = _am->slot[i];
-		if (ctx) {
-			ATOM_INC(&ctx->ref);
-			rwlock_runlock(&_am->lock);
+	int i = 0;
+
+	xu_epoch_enter();
+	t = ATOM_LOAD_ACQUIRE(&_am->tab);
+	while (i < t->size) {
+		ctx = ATOM_LOAD_ACQUIRE(&t->slot[i]);
+		if (ctx && __actor_tryref(ctx)) {
+			xu_epoch_exit();
 			f(ud, ctx);
 			xu_actor_unref(ctx);
-			rwlock_rlock(&_am->lock);
-			n = _am->slot_size;
+			xu_epoch_enter();
+			t = ATOM_LOAD_ACQUIRE(&_am->tab);
 		}
 		++i;
 	}
-	rwlock_runlock(&_am->lock);
+	xu_epoch_exit();
 }
 
 struct xu_actor *xu_handle_ref(uint32_t handle)
 {
+	struct handle_table *t;
 	struct xu_actor *rest = NULL, *ctx;
 
-	rwlock_rlock(&_am->lock);
-	uint32_t hash = handle & (_am->slot_size - 1);
-	ctx = _am->slot[hash];
+	xu_epoch_enter();
+	t = ATOM_LOAD_ACQUIRE(&_am->tab);
+	ctx = ATOM_LOAD_ACQUIRE(&t->slot[handle & (t->size - 1)]);
 	if (ctx && ctx->handle == handle) {
-		rest = ctx;
-		ATOM_INC(&rest->ref);
+		rest = __actor_tryref(ctx);
 	}
-	rwlock_runlock(&_am->lock);
+	xu_epoch_exit();
 
 	return rest;
 }
 
 static void dispatch_message(struct xu_actor *ctx, struct xu_msg *msg)
 {
+	const void *data = msg->data;
+	size_t sz = msg->size;
 	int rmsg;
 
+	if (sz & MSIZE_INLINE) {
+		data = msg->inl;
+		sz &= ~MSIZE_INLINE;
+	}
 	if (ctx->logfile)
-		xu_log_output(ctx->logfile, msg->source, msg->type, msg->data, msg->size);
+		xu_log_output(ctx->logfile, msg->source, msg->type, data, sz);
 	//fprintf(stderr, "type = %d, src = %d, len = %d\n", msg->type, msg->source, msg->size);
-	rmsg = ctx->cb(ctx, ctx->data, msg->type, msg->source, (void *)msg->data, msg->size);
-	if (!rmsg && msg->size > 0) {
-		xu_free((void *)msg->data);
+	rmsg = ctx->cb(ctx, ctx->data, msg->type, msg->source, (void *)data, sz);
+	if (!rmsg) {
+		__msg_release(msg);
 	}
 }
 
+/* worker local buffer, messages are moved here by batch from the mailbox */
+#define DISPATCH_BATCH (32)
+static __thread struct xu_msg __batch[DISPATCH_BATCH];
+
 struct queue *xu_dispatch_message(struct queue *q, int weight)
 {
 	if (q == NULL) {
@@ -577,22 +1140,28 @@ struct queue *xu_dispatch_message(struct queue *q, int weight)
 		return xu_queue_pop();
 	}
 
-	int i, n = 1;
-	struct xu_msg msg;
-	for (i = 0; i < n; ++i) {
-		if (xu_queue_get(q, &msg)) {
+	/*
+	 * weight < 0: one message, otherwise 1/(2^weight) of the mailbox.
+	 */
+	int i, n, total = 1;
+	if (weight >= 0) {
+		total = xu_queue_length(q) >> weight;
+		if (total < 1)
+			total = 1;
+	}
+	while (total > 0) {
+		n = xu_queue_get_batch(q, __batch, total < DISPATCH_BATCH ? total : DISPATCH_BATCH);
+		if (n == 0) {
 			xu_actor_unref(ctx);
 			return xu_queue_pop();
-		} else if (i == 0 && weight >= 0) {
-			n = xu_queue_length(q);
-			n >>= weight;
 		}
-
-		if (ctx->cb == NULL) {
-			if (msg.size > 0)
-				xu_free((void *)msg.data);
-		} else {
-			dispatch_message(ctx, &msg);
+		total -= n;
+		for (i = 0; i < n; ++i) {
+			if (ctx->cb == NULL) {
+				__msg_release(&__batch[i]);
+			} else {
+				dispatch_message(ctx, &__batch[i]);
+			}
 		}
 	}
 	assert(q == ctx->q);
@@ -631,8 +1200,17 @@ const char *xu_actor_namehandle(uint32_t h, const char *name)
 
 	xa = xu_handle_ref(h);
 	if (xa) {
-		xu_strlcpy(xa->name, name, sizeof xa->name);
-		r = xa->name;
+		SPIN_LOCK(_am);
+		/* retired meanwhile, its name must not be indexed again */
+		if (_am->tab->slot[h & (_am->tab->size - 1)] == xa) {
+			if (xa->name[0] != '\0')
+				__names_remove(xa->name, h);
+			xu_strlcpy(xa->name, name, sizeof xa->name);
+			if (xa->name[0] != '\0')
+				__names_insert(xa->name, h);
+			r = xa->name;
+		}
+		SPIN_UNLOCK(_am);
 		xu_actor_unref(xa);
 	}
 
@@ -641,77 +1219,192 @@ const char *xu_actor_namehandle(uint32_t h, const char *name)
 
 uint32_t xu_actor_findname(const char *name)
 {
-	struct actor_mgr *s = _am;
-	struct xu_actor *xa;
-
-	rwlock_rlock(&s->lock);
-	uint32_t h = 0;
-	for (int i = 0; i < s->slot_size; ++i) {
-		if (s->slot[i]) {
-			xa = s->slot[i];
-			if (strcmp(xa->name, name) == 0) {
-				h = xa->handle;
-				break;
-			}
+	struct name_table *t;
+	struct name_entry *e;
+	uint32_t h = 0, hash = __name_hash(name);
+
+	xu_epoch_enter();
+	t = ATOM_LOAD_ACQUIRE(&_am->names);
+	e = ATOM_LOAD_ACQUIRE(&t->bucket[hash & (t->size - 1)]);
+	for (; e; e = ATOM_LOAD_ACQUIRE(&e->next)) {
+		if (e->hash == hash && strcmp(e->name, name) == 0) {
+			h = e->handle;
+			break;
 		}
 	}
-	rwlock_runlock(&s->lock);
+	xu_epoch_exit();
 
 	return h;
 }
 
-static void __filter_args(struct xu_actor *ctx, int type, void **data, size_t *sz)
+uint32_t xu_actor_findname_cached(struct xu_name_cache *c, const char *name)
 {
-	int needcopy = !(type & MTYPE_TAG_DONTCOPY);
+	uint32_t gen = ATOM_LOAD_ACQUIRE(&_am->gen);
+
+	if (c->gen == gen && strcmp(c->name, name) == 0)
+		return c->handle;
+	/* read gen first, a change during the lookup shows up next time */
+	c->handle = xu_actor_findname(name);
+	c->gen = gen;
+	xu_strlcpy(c->name, name, sizeof c->name);
+	return c->handle;
+}
 
-	type &= 0xff;
+static int _inline = XU_MSG_INLINE_MAX;
+
+static void __notify_overload(struct queue *q, uint32_t src)
+{
+	struct xu_overload ov;
+	uint32_t sup = q->supervisor;
+	const char *name;
+
+	if (sup == 0 && (name = xu_getenv("supervisor", NULL, 0)) != NULL) {
+		if (name[0] == ':')
+			sup = strtoul(name + 1, NULL, 16);
+		else
+			sup = xu_actor_findname(name);
+	}
+	ov.handle = q->handle;
+	ov.cap = q->cap;
+	ov.policy = q->policy;
+	if (src != 0 && src != q->handle)
+		xu_send(NULL, q->handle, src, MTYPE_OVERLOAD, &ov, sizeof ov);
+	if (sup != 0 && sup != src && sup != q->handle)
+		xu_send(NULL, q->handle, sup, MTYPE_OVERLOAD, &ov, sizeof ov);
+}
+
+/*
+ * Put a message in a mailbox honouring its limit, the first overflow
+ * since the mailbox drained is reported to the sender and supervisor.
+ * return: the MQ_* code, a message not queued is released.
+ */
+static int __queue_msg(struct queue *q, struct xu_msg *msg)
+{
+	int r = xu_queue_put(q, msg);
+
+	if (r == MQ_OK)
+		return r;
+	if (q->overload == 0 && ATOM_CAS(&q->overload, 0, 1))
+		__notify_overload(q, msg->source);
+	if (r != MQ_SHED)
+		__msg_release(msg);
+	return r;
+}
+
+/* a dropped message is a success for the sender, a rejected one is not */
+static inline int __queue_result(int r)
+{
+	return r == MQ_FULL ? -3 : 0;
+}
+
+void xu_msg_inline(int max)
+{
+	if (max < 0)
+		max = 0;
+	_inline = max < XU_MSG_INLINE_MAX ? max : XU_MSG_INLINE_MAX;
+}
+
+static void __filter_args(struct xu_actor *ctx, int type, struct xu_msg *smsg, void *data, size_t sz)
+{
+	int needcopy = !(type & (MTYPE_TAG_DONTCOPY | MTYPE_TAG_SHARED));
+
+	smsg->data = data;
+	smsg->size = sz;
 	if (type & MTYPE_TAG_DASINT) {
-		*sz = 0;
-	} else if (needcopy && *data) {
-		char *msg = xu_malloc(*sz);
-		memcpy(msg, *data, *sz);
-		*data = msg;
+		smsg->size = 0;
+	} else if (needcopy && data) {
+		if (sz > 0 && sz <= _inline) {
+			memcpy(smsg->inl, data, sz);
+			smsg->size = sz | MSIZE_INLINE;
+		} else {
+			char *msg = xu_msg_alloc(sz);
+			memcpy(msg, data, sz);
+			smsg->data = msg;
+		}
 	}
 }
 
-int xu_send(struct xu_actor *ctx, uint32_t src, uint32_t dest, int type, void *msg, size_t sz)
+/* return: < 0 on error, else the MQ_* code of the receiving mailbox */
+static int __send(struct xu_actor *ctx, uint32_t src, uint32_t dest, int type, void *msg, size_t sz)
 {
 	struct xu_actor *dctx;
 	struct xu_msg smsg;
 
 	if (dest == 0) {
+		if (type & MTYPE_TAG_SHARED)
+			xu_msg_free(msg);
 		return -1;
 	}
 
 	dctx = xu_handle_ref(dest);
 	if (dctx == NULL) {
+		if (type & MTYPE_TAG_SHARED)
+			xu_msg_free(msg);
 		return -2;
 	}
 
 	if ((sz & MESSAGE_TYPE_MASK) != sz) {
 		xu_error(ctx, "The message to %x is too large", dest);
-		if (type & MTYPE_TAG_DONTCOPY) {
-			xu_free(msg);
+		if (type & (MTYPE_TAG_DONTCOPY | MTYPE_TAG_SHARED)) {
+			xu_msg_free(msg);
 		}
 		xu_actor_unref(dctx);
 		return -1;
 	}
 
-	__filter_args(ctx, type, &msg, &sz);
+	__filter_args(ctx, type, &smsg, msg, sz);
 
 	if (src == 0) {
 		src = ctx->handle;
 	}
 
 	smsg.source = src;
-	smsg.data = msg;
 	smsg.type = type & MESSAGE_TYPE_MASK;
-	smsg.size = sz;
 
-	xu_queue_put(dctx->q, &smsg);
+	int r = __queue_msg(dctx->q, &smsg);
 	xu_actor_unref(dctx);
 
-	return 0;
+	return r;
+}
+
+int xu_send(struct xu_actor *ctx, uint32_t src, uint32_t dest, int type, void *msg, size_t sz)
+{
+	int r = __send(ctx, src, dest, type, msg, sz);
+
+	return r < 0 ? r : __queue_result(r);
+}
+
+int xu_send_group(struct xu_actor *ctx, const uint32_t *handles, int n, int type, void *msg, size_t sz)
+{
+	int i, r, sent = 0;
+
+	if (sz == 0) { /* no payload to release on the receiving side */
+		xu_msg_free(msg);
+		return 0;
+	}
+	type = (type & ~MTYPE_TAG_DONTCOPY) | MTYPE_TAG_SHARED;
+	/* one reference per receiver, failed sends drop theirs */
+	xu_msg_retain(msg, n);
+	for (i = 0; i < n; ++i) {
+		/* a dropping mailbox doesn't count as reached */
+		r = __send(ctx, 0, handles[i], type, msg, sz);
+		if (r == MQ_OK || r == MQ_SHED)
+			++sent;
+	}
+	xu_msg_free(msg);
+
+	return sent;
+}
+
+/* per thread cache of names resolved by xu_sendname */
+#define NAME_CACHE_SIZE 8
+static __thread struct xu_name_cache __ncache[NAME_CACHE_SIZE];
+
+static uint32_t __sendname_lookup(const char *name)
+{
+	struct xu_name_cache *c = &__ncache[__name_hash(name) & (NAME_CACHE_SIZE - 1)];
+
+	return xu_actor_findname_cached(c, name);
 }
 
 int xu_sendname(struct xu_actor *context, uint32_t source, const char *addr , int type, void * data, size_t sz)
@@ -723,14 +1416,16 @@ int xu_sendname(struct xu_actor *context, uint32_t source, const char *addr , in
 	if (addr[0] == ':') {
 		des = strtoul(addr+1, NULL, 16);
 	} else if (addr[0] == '.') {
-		des = xu_actor_findname(addr + 1);
+		des = __sendname_lookup(addr + 1);
 		if (des == 0) {
-			if (type & MTYPE_TAG_DONTCOPY) {
-				xu_free(data);
+			if (type & (MTYPE_TAG_DONTCOPY | MTYPE_TAG_SHARED)) {
+				xu_msg_free(data);
 			}
 			return -1;
 		}
 	} else {
+		if (type & MTYPE_TAG_SHARED)
+			xu_msg_free(data);
 		return -2;
 	}
 	return xu_send(context, source, des, type, data, sz);
@@ -743,9 +1438,9 @@ int xu_handle_msgput(uint32_t handle, struct xu_msg *msg)
 	if (ctx == NULL) {
 		return -1;
 	}
-	xu_queue_put(ctx->q, msg);
+	int r = __queue_msg(ctx->q, msg);
 	xu_actor_unref(ctx);
-	return 0;
+	return __queue_result(r);
 }
 
 uint32_t xu_actor_handle(struct xu_actor *ctx)
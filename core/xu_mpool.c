@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "xu_impl.h"
+#include "xu_kern.h"
+
+/*
+ * Message payload allocator.
+ *
+ * Small payloads come from size classes cached per thread.  A message is
+ * usually allocated by the sender's thread and freed by the receiver's
+ * one, so a thread cache which grows too big gives a batch of blocks
+ * back to a global depot, and a thread cache which runs dry takes one.
+ *
+ * Every block carries a reference count so one payload can be queued to
+ * many actors (MTYPE_TAG_SHARED), the last xu_msg_free releases it.
+ */
+#define MCLASS_NUM    8
+#define MCLASS_LARGE  0xff
+#define MBATCH        32                /* blocks moved to/from the depot */
+#define MCACHE_MAX    (MBATCH * 2)      /* blocks a thread keeps per class */
+#define MDEPOT_MAX    64                /* batches the depot keeps per class */
+
+static const uint32_t _mclass[MCLASS_NUM] = {
+	16, 32, 48, 64, 96, 128, 192, XU_MPOOL_MAX
+};
+
+struct mblock {
+	union {
+		struct mblock *next; /* free list */
+		struct {
+			uint32_t cls;
+			int      ref;
+		} h;
+		uint64_t align;
+	} u;
+};
+
+/* a batch in the depot is a free list, its head's payload links batches */
+struct mbatch {
+	struct mblock *next;
+	int count;
+};
+
+#define MBLOCK(p)  ((struct mblock *)(p) - 1)
+#define MBATCH_HDR(b)  ((struct mbatch *)((b) + 1))
+
+struct mbin {
+	struct mblock *head;
+	int count;
+};
+
+struct tcache {
+	struct tcache *next;
+	struct mbin bin[MCLASS_NUM];
+	uint64_t alloc;
+	uint64_t hit;
+	uint64_t large;
+	size_t   cached;
+	int      init;
+};
+
+struct depot {
+	struct spinlock lock;
+	struct mblock *batch;
+	int count;
+};
+
+struct mpool {
+	struct spinlock lock;
+	struct tcache *caches;
+	struct depot depot[MCLASS_NUM];
+	pthread_key_t key;
+	int init;
+	/* counters of exited threads */
+	uint64_t alloc;
+	uint64_t hit;
+	uint64_t large;
+};
+
+static struct mpool _P[1];
+static __thread struct tcache __tc;
+
+static inline int __class(size_t sz)
+{
+	int i;
+
+	for (i = 0; i < MCLASS_NUM; ++i) {
+		if (sz <= _mclass[i])
+			return i;
+	}
+	return MCLASS_LARGE;
+}
+
+static void __depot_put(int cls, struct mblock *batch, int count)
+{
+	struct depot *d = &_P->depot[cls];
+	struct mblock *b, *n;
+
+	SPIN_LOCK(d);
+	if (d->count < MDEPOT_MAX) {
+		MBATCH_HDR(batch)->next = d->batch;
+		MBATCH_HDR(batch)->count = count;
+		d->batch = batch;
+		d->count++;
+		batch = NULL;
+	}
+	SPIN_UNLOCK(d);
+
+	/* depot full, give the memory back */
+	for (b = batch; b; b = n) {
+		n = b->u.next;
+		xu_free(b);
+	}
+}
+
+static struct mblock *__depot_get(int cls)
+{
+	struct depot *d = &_P->depot[cls];
+	struct mblock *batch = NULL;
+
+	if (d->batch == NULL)
+		return NULL;
+	SPIN_LOCK(d);
+	if ((batch = d->batch) != NULL) {
+		d->batch = MBATCH_HDR(batch)->next;
+		d->count--;
+	}
+	SPIN_UNLOCK(d);
+	return batch;
+}
+
+/* give blocks above `keep' to the depot, by batches */
+static void __flush_bin(struct tcache *tc, int cls, int keep)
+{
+	struct mbin *bin = &tc->bin[cls];
+	struct mblock *batch, *last;
+	int i;
+
+	while (bin->count > keep) {
+		batch = last = bin->head;
+		for (i = 1; i < MBATCH && last->u.next; ++i) {
+			last = last->u.next;
+		}
+		bin->head = last->u.next;
+		bin->count -= i;
+		tc->cached -= i * _mclass[cls];
+		last->u.next = NULL;
+		__depot_put(cls, batch, i);
+	}
+}
+
+static void __tcache_exit(void *ud)
+{
+	struct tcache *tc = ud, **it;
+	int i;
+
+	for (i = 0; i < MCLASS_NUM; ++i) {
+		__flush_bin(tc, i, 0);
+	}
+	SPIN_LOCK(_P);
+	for (it = &_P->caches; *it; it = &(*it)->next) {
+		if (*it == tc) {
+			*it = tc->next;
+			break;
+		}
+	}
+	_P->alloc += tc->alloc;
+	_P->hit   += tc->hit;
+	_P->large += tc->large;
+	SPIN_UNLOCK(_P);
+	tc->init = 0;
+}
+
+static struct tcache *__tcache(void)
+{
+	struct tcache *tc = &__tc;
+
+	if (!tc->init) {
+		SPIN_LOCK(_P);
+		if (!_P->init) {
+			pthread_key_create(&_P->key, __tcache_exit);
+			_P->init = 1;
+		}
+		tc->next = _P->caches;
+		_P->caches = tc;
+		SPIN_UNLOCK(_P);
+		pthread_setspecific(_P->key, tc);
+		tc->init = 1;
+	}
+	return tc;
+}
+
+void *xu_msg_alloc(size_t sz)
+{
+	struct tcache *tc = __tcache();
+	struct mbin *bin;
+	struct mblock *b;
+	int cls = __class(sz);
+
+	tc->alloc++;
+	if (cls == MCLASS_LARGE) {
+		tc->large++;
+		b = xu_malloc(sizeof *b + sz);
+	} else {
+		bin = &tc->bin[cls];
+		if (bin->head == NULL && (bin->head = __depot_get(cls)) != NULL) {
+			bin->count = MBATCH_HDR(bin->head)->count;
+			tc->cached += bin->count * _mclass[cls];
+		}
+		if ((b = bin->head) != NULL) {
+			bin->head = b->u.next;
+			bin->count--;
+			tc->cached -= _mclass[cls];
+			tc->hit++;
+		} else {
+			b = xu_malloc(sizeof *b + _mclass[cls]);
+		}
+	}
+	b->u.h.cls = cls;
+	b->u.h.ref = 1;
+
+	return b + 1;
+}
+
+void xu_msg_free(void *p)
+{
+	struct tcache *tc;
+	struct mbin *bin;
+	struct mblock *b;
+	int cls;
+
+	if (p == NULL)
+		return;
+	b = MBLOCK(p);
+	/* shared by other holders, just drop our reference */
+	if (ATOM_LOAD_ACQUIRE(&b->u.h.ref) != 1 && ATOM_DEC(&b->u.h.ref) > 0)
+		return;
+	cls = b->u.h.cls;
+	if (cls == MCLASS_LARGE) {
+		xu_free(b);
+		return;
+	}
+	tc = __tcache();
+	bin = &tc->bin[cls];
+	b->u.next = bin->head;
+	bin->head = b;
+	bin->count++;
+	tc->cached += _mclass[cls];
+	if (bin->count > MCACHE_MAX) {
+		__flush_bin(tc, cls, MCACHE_MAX - MBATCH);
+	}
+}
+
+void *xu_msg_retain(void *p, int n)
+{
+	ATOM_ADD(&MBLOCK(p)->u.h.ref, n);
+	return p;
+}
+
+void *xu_msg_shrink(void *p, size_t sz)
+{
+	struct mblock *b = MBLOCK(p);
+
+	if (b->u.h.cls != MCLASS_LARGE || b->u.h.ref != 1)
+		return p;
+	b = xu_realloc(b, sizeof *b + sz);
+	return b + 1;
+}
+
+void xu_msg_stat(struct xu_msg_stat *st)
+{
+	struct tcache *tc;
+	int i;
+
+	memset(st, 0, sizeof *st);
+	SPIN_LOCK(_P);
+	st->alloc = _P->alloc;
+	st->hit   = _P->hit;
+	st->large = _P->large;
+	for (tc = _P->caches; tc; tc = tc->next) {
+		st->alloc  += tc->alloc;
+		st->hit    += tc->hit;
+		st->large  += tc->large;
+		st->cached += tc->cached;
+	}
+	SPIN_UNLOCK(_P);
+	for (i = 0; i < MCLASS_NUM; ++i) {
+		struct depot *d = &_P->depot[i];
+		struct mblock *b;
+
+		SPIN_LOCK(d);
+		for (b = d->batch; b; b = MBATCH_HDR(b)->next) {
+			st->cached += (size_t)MBATCH_HDR(b)->count * _mclass[i];
+		}
+		SPIN_UNLOCK(d);
+	}
+}
@@ -4,15 +4,22 @@
 #include <string.h>
 #include <limits.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
 #include "xu_impl.h"
 #include "xu_kern.h"
 #include "cJSON.h"
 #include "uv.h"
 
 #define XU_DEFAULT_THREADS (2)
-struct workqueue {
-	uv_work_t req;
-	int busy;
+
+struct worker;
+
+struct thread {
+	pthread_t tid;
+	int id;
+	int weight;
+	struct worker *w;
 };
 
 struct worker {
@@ -22,12 +29,21 @@ struct worker {
 
 	uv_prepare_t wup;
 
+	/* sub-ms timer tick, the wheels are driven by a thread of their own */
+	pthread_t ticker;
+	int hires;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+
 	int sleep;
 	int quit;
 
-	struct workqueue wq[0];
+	struct thread thr[0];
 };
 
+static struct worker *_W = NULL;
+
 static void *__malloc(size_t sz)
 {
 	return xu_malloc(sz);
@@ -119,14 +135,6 @@ void xu_kern_init(int argc, char *argv[])
 
 	parsing(argc, argv);
 
-	if ((s = xu_getenv("threads", NULL, 0)) != NULL) {
-		setenv("UV_THREADPOOL_SIZE", s, 1);
-	} else {
-		char thr[4] = {0};
-		snprintf(thr, sizeof thr, "%d", XU_DEFAULT_THREADS);
-		setenv("UV_THREADPOOL_SIZE", thr, 1);
-	}
-
 	if ((s = xu_getenv("logpath", NULL, 0)) != NULL) {
 		mkdir(s, 0755);
 	}
@@ -139,44 +147,68 @@ void xu_kern_init(int argc, char *argv[])
 	load_logger();
 }
 
-static void on_work(uv_work_t *req)
+/*
+ * Wake up a parked worker, called when a queue becomes runnable.
+ */
+void xu_worker_wakeup(void)
 {
-	struct worker *w = req->data;
-	struct queue *q = NULL;
+	struct worker *w = _W;
 
-	do {
-		q = xu_dispatch_message(q, 0);
-	} while (q && !w->quit);
+	if (w == NULL)
+		return;
+	__sync_synchronize();
+	if (w->sleep > 0) {
+		pthread_mutex_lock(&w->mutex);
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->mutex);
+	}
 }
 
-static void on_done(uv_work_t *req, int status)
+static void *on_work(void *p)
 {
-	struct worker *w = req->data;
-	struct workqueue *wq = (struct workqueue *)req;
+	struct thread *t = p;
+	struct worker *w = t->w;
+	struct queue *q = NULL;
 
-	ATOM_CAS(&wq->busy, 1, 0);
-	ATOM_INC(&w->sleep);
-/*	xu_error(NULL, "thread %p done: %d", wq, w->sleep); */
+	xu_sched_worker(t->id);
+	while (!w->quit) {
+		q = xu_dispatch_message(q, t->weight);
+		if (q != NULL)
+			continue;
+		/*
+		 * Nothing runnable: announce we are going to sleep before the
+		 * last look, a pusher which misses `sleep' will be seen here.
+		 */
+		pthread_mutex_lock(&w->mutex);
+		ATOM_INC(&w->sleep);
+		if (!w->quit && (q = xu_queue_pop()) == NULL) {
+			pthread_cond_wait(&w->cond, &w->mutex);
+		}
+		ATOM_DEC(&w->sleep);
+		pthread_mutex_unlock(&w->mutex);
+	}
+	xu_sched_worker(-1);
+	return NULL;
 }
 
-static void do_wakeup(struct worker *w, int busy)
+/*
+ * Per worker dispatch weights, `weights' is a list like "-1,-1,0,0,1,1",
+ * worker i takes the i-th one, missing ones are 0.
+ *  -1: one message per round, n: 1/(2^n) of the mailbox per round.
+ */
+static void load_weights(struct worker *w)
 {
-	int i;
-	struct workqueue *wq;
-	if (w->sleep >= w->count - busy) {
-		for (i = 0; i < w->count; ++i) {
-			wq = &w->wq[i];
-			if (wq->busy == 0) {
-				ATOM_CAS(&wq->busy, 0, 1);
-				if (uv_queue_work(uv_default_loop(), &wq->req, on_work, on_done) == 0) {
-					ATOM_DEC(&w->sleep);
-/*					xu_error(NULL, "thread %p wakeup: %d", wq, w->sleep); */
-					break;
-				} else {
-					ATOM_CAS(&wq->busy, 1, 0);
-				}
-			}
-		}
+	char buf[256] = {0};
+	char *p, *args;
+	int i = 0;
+
+	if (xu_getenv("weights", buf, sizeof buf) == NULL)
+		return;
+	args = buf;
+	while (i < w->count && (p = strsep(&args, ", \t")) != NULL) {
+		if (*p == '\0')
+			continue;
+		w->thr[i++].weight = atoi(p);
 	}
 }
 
@@ -184,60 +216,115 @@ static void on_timer(uv_timer_t *d)
 {
 	struct worker *w = d->data;
 
-	xu_updatetime();
-	do_wakeup(w, w->count - 1);
+	if (!w->hires)
+		xu_updatetime();
+	xu_epoch_reclaim();
+}
+
+static void *on_tick(void *p)
+{
+	struct worker *w = p;
+	struct itimerspec its;
+	uint32_t tick = xu_timer_tick();
+	uint64_t n;
+	int fd;
+
+	memset(&its, 0, sizeof its);
+	its.it_interval.tv_sec = tick / 1000000;
+	its.it_interval.tv_nsec = (tick % 1000000) * 1000;
+	its.it_value = its.it_interval;
+	if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) >= 0 &&
+		timerfd_settime(fd, 0, &its, NULL) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0)
+		xu_error(NULL, "can't arm the timer tick, sleeping instead");
+	while (!w->quit) {
+		/* n > 1: ticks missed, xu_updatetime catches up by itself */
+		if (fd < 0)
+			usleep(tick);
+		else if (read(fd, &n, sizeof n) != sizeof n)
+			continue;
+		xu_updatetime();
+	}
+	if (fd >= 0)
+		close(fd);
+	return NULL;
 }
 
 static void on_prepare(uv_prepare_t *p)
 {
 	struct worker *w = p->data;
-	struct workqueue *wq;
 	int i;
 
 	if (xu_actors_total() == 0) { /* stop loopping */
 		fprintf(stderr, "stopping\n");
+		pthread_mutex_lock(&w->mutex);
 		ATOM_CAS(&w->quit, 0, 1);
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->mutex);
 		for (i = 0; i < w->count; ++i) {
-			wq = &w->wq[i];
-			if (wq->busy) {
-				uv_cancel((uv_req_t *)&wq->req);
-			}
+			pthread_join(w->thr[i].tid, NULL);
 		}
+		if (w->hires)
+			pthread_join(w->ticker, NULL);
+		uv_prepare_stop(&w->wup);
+		uv_timer_stop(&w->sched);
 		uv_stop(uv_default_loop());
-	} else {
-		do_wakeup(w, 0);
 	}
 }
 
 static void __kern_prestart()
 {
 	struct worker *w;
-	struct workqueue *wq;
+	struct thread *t;
 	int i, threads = XU_DEFAULT_THREADS;
-	char *s;
+	const char *s;
 	uv_loop_t *loop = uv_default_loop();
 
-	s = getenv("UV_THREADPOOL_SIZE");
-	if (s) 
+	s = xu_getenv("threads", NULL, 0);
+	if (s && atoi(s) > 0)
 		threads = atoi(s);
-	w = xu_calloc(1, sizeof *w + threads * sizeof (struct workqueue));
+	w = xu_calloc(1, sizeof *w + threads * sizeof (struct thread));
 	w->count = threads;
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->cond, NULL);
 
-	for (i = 0; i < threads; ++i) {
-		wq = &w->wq[i];
-		wq->busy = 0;
-		wq->req.data = w;
-	}
+	s = xu_getenv("scheduler", NULL, 0);
+	xu_sched_init(threads, s && strcmp(s, "steal") == 0);
+	load_weights(w);
+	if ((s = xu_getenv("inline", NULL, 0)) != NULL)
+		xu_msg_inline(atoi(s));
 
 	uv_timer_init(loop, &w->sched);
 	uv_timer_start(&w->sched, on_timer, 3, 3);
 	w->sched.data = w;
-	w->sleep = threads;
+	if (xu_timer_tick() < 1000) {
+		w->hires = 1;
+		if (pthread_create(&w->ticker, NULL, on_tick, w) != 0) {
+			xu_error(NULL, "can't create the timer thread, fall back to 1 ms");
+			w->hires = 0;
+			uv_timer_start(&w->sched, on_timer, 1, 1);
+		}
+	}
 
 	uv_prepare_init(loop, &w->wup);
 	uv_prepare_start(&w->wup, on_prepare);
 	w->wup.data = w;
 
+	_W = w;
+	for (i = 0; i < threads; ++i) {
+		t = &w->thr[i];
+		t->id = i;
+		t->w = w;
+		if (pthread_create(&t->tid, NULL, on_work, t) != 0) {
+			fprintf(stderr, "can't create worker thread %d\n", i);
+			fflush(stderr);
+			exit(-1);
+		}
+	}
+
 	bootstrap();
 }
 
@@ -12,48 +12,191 @@
 #define TIME_NEAR_MASK   (TIME_NEAR - 1)
 #define TIME_LEVEL_MASK  (TIME_LEVEL - 1)
 
-struct timer_event {
-	uint32_t handle;
-	int      session;
-};
-
 struct timer_node {
 	struct timer_node *next;
+	struct timer_node *prev;
+	/* session index chain */
+	struct timer_node *hnext;
+	struct timer_node **hprev;
 	uint32_t expire;
+	uint32_t handle;
+	int      session;
 };
 
+/* a circular list, `head' is the sentinel */
 struct link_list {
 	struct timer_node head;
-	struct timer_node *tail;
 };
 
+#define TIME_INDEX_SIZE 1024
+#define TIME_POOL_SIZE  1024 /* default nodes preallocated, env `timer_pool' */
+#define TIME_POOL_CHUNK 256  /* nodes added when the pool runs dry */
+#define TIME_SHARDS     8    /* default wheels, env `timer_shards' */
+#define TIME_TICK       1000 /* default tick in us, env `timer_tick' */
+#define TIME_TICK_MIN   10
+
+/*
+ * A timer wheel.  Timers are spread over several wheels by handle, so
+ * actors arming timers on different workers rarely share a lock; all
+ * the wheels advance from the same tick, in xu_updatetime.
+ */
 struct timer {
 	struct link_list near[TIME_NEAR];
 	struct link_list t[4][TIME_LEVEL];
 	struct spinlock  lock;
 	uint32_t         time;
+	/* (handle, session) -> pending node */
+	struct timer_node **index;
+	int              index_size;
+	int              index_count;
+	/* node pool, chunks are never released */
+	struct timer_node *pool;
+	uint32_t         pool_size;
+	uint32_t         pool_free;
+	uint32_t         chunks;
+} __attribute__((aligned(64)));
+
+/* times in us, the wheels advance by whole ticks */
+struct timer_clock {
 	uint32_t         starttime;
 	uint64_t         current;
 	uint64_t         current_point;
+	uint32_t         tick;
+	uint32_t         rest;  /* elapsed us not turned into ticks yet */
+	int              shards;
+	struct timer    *wheel;
 };
 
-static struct timer __TM[1];
+static struct timer_clock __TM[1];
+
+static inline struct timer *__wheel(uint32_t handle)
+{
+	return &__TM->wheel[handle & (__TM->shards - 1)];
+}
+
+static inline int link_empty(struct link_list *list)
+{
+	return list->head.next == &list->head;
+}
 
+/* detach all the nodes, return them as a NULL terminated list */
 static inline struct timer_node *link_clear(struct link_list *list)
 {
-	struct timer_node *r = list->head.next;
+	struct timer_node *r = NULL;
 
-	list->head.next = 0;
-	list->tail = &(list->head);
+	if (list->head.next != NULL && !link_empty(list)) {
+		r = list->head.next;
+		list->head.prev->next = NULL;
+	}
+	list->head.next = list->head.prev = &list->head;
 
 	return r;
 }
 
 static inline void link(struct link_list *list, struct timer_node *node)
 {
-	list->tail->next = node;
-	list->tail = node;
-	node->next = 0;
+	node->prev = list->head.prev;
+	node->next = &list->head;
+	list->head.prev->next = node;
+	list->head.prev = node;
+}
+
+static inline void unlink(struct timer_node *node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+}
+
+static inline uint32_t index_hash(uint32_t handle, int session)
+{
+	return (handle * 2654435761u) ^ (uint32_t)session;
+}
+
+static void index_link(struct timer_node **bucket, struct timer_node *node)
+{
+	node->hnext = *bucket;
+	if (*bucket)
+		(*bucket)->hprev = &node->hnext;
+	*bucket = node;
+	node->hprev = bucket;
+}
+
+static void index_grow(struct timer *T)
+{
+	int i, size = T->index_size * 2;
+	struct timer_node **index = xu_calloc(size, sizeof index[0]);
+	struct timer_node *node, *next;
+
+	for (i = 0; i < T->index_size; ++i) {
+		for (node = T->index[i]; node; node = next) {
+			next = node->hnext;
+			index_link(&index[index_hash(node->handle, node->session) & (size - 1)], node);
+		}
+	}
+	xu_free(T->index);
+	T->index = index;
+	T->index_size = size;
+}
+
+static void index_insert(struct timer *T, struct timer_node *node)
+{
+	if (T->index_count >= T->index_size)
+		index_grow(T);
+	index_link(&T->index[index_hash(node->handle, node->session) & (T->index_size - 1)], node);
+	T->index_count++;
+}
+
+static void index_remove(struct timer *T, struct timer_node *node)
+{
+	*node->hprev = node->hnext;
+	if (node->hnext)
+		node->hnext->hprev = node->hprev;
+	T->index_count--;
+}
+
+static struct timer_node *index_find(struct timer *T, uint32_t handle, int session)
+{
+	struct timer_node *node = T->index[index_hash(handle, session) & (T->index_size - 1)];
+
+	while (node && (node->handle != handle || node->session != session))
+		node = node->hnext;
+	return node;
+}
+
+/* T locked */
+static void pool_grow(struct timer *T, int n)
+{
+	struct timer_node *chunk = xu_calloc(n, sizeof *chunk);
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		chunk[i].next = T->pool;
+		T->pool = &chunk[i];
+	}
+	T->pool_size += n;
+	T->pool_free += n;
+	T->chunks++;
+}
+
+/* T locked */
+static inline struct timer_node *node_get(struct timer *T)
+{
+	struct timer_node *node;
+
+	if (T->pool == NULL)
+		pool_grow(T, TIME_POOL_CHUNK);
+	node = T->pool;
+	T->pool = node->next;
+	T->pool_free--;
+	return node;
+}
+
+/* T locked, give back a NULL terminated list */
+static inline void node_put(struct timer *T, struct timer_node *head, struct timer_node *tail, int n)
+{
+	tail->next = T->pool;
+	T->pool = head;
+	T->pool_free += n;
 }
 
 static void add_node(struct timer *T,struct timer_node *node) {
@@ -76,16 +219,29 @@ static void add_node(struct timer *T,struct timer_node *node) {
 	}
 }
 
-static void timer_add(struct timer *T,void *arg, size_t sz,int time)
+/*
+ * `slack' ticks late is fine: expire at a multiple of the largest power
+ * of 2 not above it, timers with the same slack then fire in the same
+ * tick.  Every wheel advances by the same ticks, so this holds across
+ * wheels too.
+ */
+static void timer_add(struct timer *T, uint32_t handle, int session, int time, uint32_t slack)
 {
-	struct timer_node *node = (struct timer_node *)xu_malloc(sizeof(*node)+sz);
-
-	memcpy(node+1,arg,sz);
+	struct timer_node *node;
+	uint32_t g;
 
 	spinlock_lock(&T->lock);
 
+	node = node_get(T);
+	node->handle = handle;
+	node->session = session;
 	node->expire = time + T->time;
+	if (slack > 1) {
+		g = 1u << (31 - __builtin_clz(slack));
+		node->expire = (node->expire + g - 1) & ~(g - 1);
+	}
 	add_node(T, node);
+	index_insert(T, node);
 
 	spinlock_unlock(&T->lock);
 }
@@ -124,64 +280,214 @@ static void timer_shift(struct timer *tm)
 	}
 }
 
-static inline void dispatch_list(struct timer_node *tn)
+/* stable merge sort of a NULL terminated list by handle */
+static struct timer_node *sort_list(struct timer_node *list)
 {
-	struct timer_event *te;
-	struct timer_node *tr;
+	struct timer_node *a, *b, *slow, *fast, head, *t;
+
+	if (list == NULL || list->next == NULL)
+		return list;
+	slow = list;
+	fast = list->next;
+	while (fast && fast->next) {
+		slow = slow->next;
+		fast = fast->next->next;
+	}
+	b = slow->next;
+	slow->next = NULL;
+	a = sort_list(list);
+	b = sort_list(b);
+	for (t = &head; a && b; t = t->next) {
+		if (b->handle < a->handle) {
+			t->next = b;
+			b = b->next;
+		} else {
+			t->next = a;
+			a = a->next;
+		}
+	}
+	t->next = a ? a : b;
+	return head.next;
+}
 
-	do {
-		te = (struct timer_event *)(tn + 1);
-		struct xu_actor *ctx = xu_handle_ref(te->handle);
-		if (ctx) {
-			xu_send(ctx, 0, te->handle, MTYPE_TIMEOUT | MTYPE_TAG_DONTCOPY, (void *)te->session, 0);
+static inline void dispatch_one(struct timer_node *tn)
+{
+	/* the receiver is its own source, xu_send looks it up once */
+	xu_send(NULL, tn->handle, tn->handle, MTYPE_TIMEOUT | MTYPE_TAG_DONTCOPY, (void *)(intptr_t)tn->session, 0);
+}
+
+/* sessions in one MTYPE_TIMEOUTS message at most */
+#define TIMEOUTS_MAX ((int)(MESSAGE_TYPE_MASK / sizeof (int)))
+
+/*
+ * n timeouts of one actor, starting at tn, as MTYPE_TIMEOUTS messages of
+ * up to TIMEOUTS_MAX sessions.  A message that can't be sent goes one
+ * timeout at a time.
+ */
+static void dispatch_batch(struct xu_actor *ctx, struct timer_node *tn, int n)
+{
+	int sessions[XU_MSG_INLINE_MAX / sizeof (int)];
+	int i, m, *p, type;
+	struct timer_node *t;
+
+	for (; n > 0; n -= m) {
+		m = n < TIMEOUTS_MAX ? n : TIMEOUTS_MAX;
+		p = sessions;
+		type = MTYPE_TIMEOUTS;
+		if (m > sizeof sessions / sizeof sessions[0]) {
+			p = xu_msg_alloc(m * sizeof (int));
+			type |= MTYPE_TAG_DONTCOPY;
+		}
+		for (i = 0, t = tn; i < m; ++i, t = t->next) {
+			p[i] = t->session;
+		}
+		if (xu_send(ctx, 0, xu_actor_handle(ctx), type, p, m * sizeof (int)) != 0) {
+			for (i = 0; i < m; ++i, tn = tn->next)
+				dispatch_one(tn);
+		}
+		tn = t;
+	}
+}
+
+/*
+ * Send the expired timeouts, actors which asked for it get theirs
+ * together in one message.  Return the list, reordered by handle.
+ */
+static struct timer_node *dispatch_list(struct timer_node *list)
+{
+	struct timer_node *tn, *run;
+	struct xu_actor *ctx;
+	int n;
+
+	if (xu_timerbatch_actors() == 0) {
+		for (tn = list; tn; tn = tn->next)
+			dispatch_one(tn);
+		return list;
+	}
+	list = sort_list(list);
+	for (run = list; run; run = tn) {
+		for (n = 1, tn = run->next; tn && tn->handle == run->handle; tn = tn->next)
+			++n;
+		if (n > 1 && (ctx = xu_handle_ref(run->handle)) != NULL) {
+			if (xu_actor_timerbatch(ctx)) {
+				dispatch_batch(ctx, run, n);
+				xu_actor_unref(ctx);
+				continue;
+			}
 			xu_actor_unref(ctx);
 		}
-		tr = tn;
-		tn = tn->next;
-		xu_free(tr);
-	} while (tn);
+		for (tn = run; n-- > 0; tn = tn->next)
+			dispatch_one(tn);
+	}
+	return list;
 }
 
-static inline void timer_execute(struct timer *tn)
+/* T locked, move the expired nodes of the current slot to the list */
+static inline void timer_collect(struct timer *T, struct timer_node **head, struct timer_node **last, int *n)
 {
-	int idx = tn->time & TIME_NEAR_MASK;
+	int idx = T->time & TIME_NEAR_MASK;
+	struct timer_node *node;
+
+	if (link_empty(&T->near[idx]))
+		return;
+	node = link_clear(&T->near[idx]);
+	if (*last)
+		(*last)->next = node;
+	else
+		*head = node;
+	/* fired, can't be cancelled any more */
+	for (; node; node = node->next) {
+		index_remove(T, node);
+		*last = node;
+		++*n;
+	}
+}
 
-	while (tn->near[idx].head.next) {
-		struct timer_node *cur = link_clear(&tn->near[idx]);
+/*
+ * T locked, ticks (1..max) to the next one with work: a near slot holding
+ * nodes, or the end of the near wheel where the levels cascade.
+ */
+static inline uint32_t timer_next(struct timer *T, uint32_t max)
+{
+	uint32_t d, end = TIME_NEAR - (T->time & TIME_NEAR_MASK);
 
-		SPIN_UNLOCK(tn);
-		dispatch_list(cur);
-		SPIN_LOCK(tn);
+	if (end > max)
+		end = max;
+	for (d = 1; d < end; ++d) {
+		if (!link_empty(&T->near[(T->time + d) & TIME_NEAR_MASK]))
+			return d;
 	}
+	return end;
 }
 
-static void timer_update(struct timer *tr)
+/*
+ * Advance the wheel by `ticks' in one locked pass, jumping over the ticks
+ * with nothing to do, so the levels cascade once per near wheel turn.  The
+ * nodes expired on the way are dispatched together once unlocked.
+ */
+static void timer_update(struct timer *T, uint32_t ticks)
 {
-	SPIN_LOCK(tr);
-	timer_execute(tr);
-	timer_shift(tr);
-	timer_execute(tr);
-	SPIN_UNLOCK(tr);
+	struct timer_node *head = NULL, *last = NULL;
+	uint32_t d;
+	int n = 0;
+
+	SPIN_LOCK(T);
+	timer_collect(T, &head, &last, &n);
+	if (T->index_count == 0) {
+		/* nothing pending, the wheel is empty */
+		T->time += ticks;
+	} else {
+		for (; ticks > 0; ticks -= d) {
+			if (T->index_count == 0) {
+				T->time += ticks;
+				break;
+			}
+			d = timer_next(T, ticks);
+			T->time += d - 1;
+			timer_shift(T);
+			timer_collect(T, &head, &last, &n);
+		}
+	}
+	SPIN_UNLOCK(T);
+
+	if (head) {
+		head = dispatch_list(head);
+		for (last = head; last->next; last = last->next)
+			;
+		SPIN_LOCK(T);
+		node_put(T, head, last, n);
+		SPIN_UNLOCK(T);
+	}
 }
 
 uint64_t xu_now(void)
+{
+	return __TM->current / 1000;
+}
+
+uint64_t xu_now_us(void)
 {
 	return __TM->current;
 }
 
+uint32_t xu_timer_tick(void)
+{
+	return __TM->tick;
+}
+
 uint64_t xu_starttime(void)
 {
 	return __TM->starttime;
 }
 
-static void systime(uint32_t *sec, uint32_t *cs)
+static void systime(uint32_t *sec, uint32_t *us)
 {
 	struct timespec ti;
 
 	clock_gettime(CLOCK_REALTIME, &ti);
 
 	*sec = (uint32_t)ti.tv_sec;
-	*cs  = (uint32_t)(ti.tv_nsec / 1000000);
+	*us  = (uint32_t)(ti.tv_nsec / 1000);
 }
 
 static uint64_t gettime(void)
@@ -190,17 +496,15 @@ static uint64_t gettime(void)
 	struct timespec ti;
 
 	clock_gettime(CLOCK_MONOTONIC, &ti);
-	t = (uint64_t)ti.tv_sec * 1000;
-	t += ti.tv_nsec / 1000000;
+	t = (uint64_t)ti.tv_sec * 1000000;
+	t += ti.tv_nsec / 1000;
 
 	return t;
 }
 
-void xu_timer_init(void)
+static void wheel_init(struct timer *r, int pool)
 {
 	int i, j;
-	uint32_t cur = 0;
-	struct timer *r = __TM;
 
 	for (i = 0; i < TIME_NEAR; ++i) {
 		link_clear(&r->near[i]);
@@ -210,7 +514,39 @@ void xu_timer_init(void)
 			link_clear(&r->t[i][j]);
 		}
 	}
+	r->index_size = TIME_INDEX_SIZE;
+	r->index = xu_calloc(r->index_size, sizeof r->index[0]);
+	r->index_count = 0;
+	pool_grow(r, pool);
+	r->chunks = 0;
 	spinlock_init(&r->lock);
+}
+
+void xu_timer_init(void)
+{
+	int i, shards = TIME_SHARDS, pool = TIME_POOL_SIZE;
+	uint32_t cur = 0;
+	struct timer_clock *r = __TM;
+	const char *s;
+
+	if ((s = xu_getenv("timer_shards", NULL, 0)) != NULL && atoi(s) > 0)
+		shards = atoi(s);
+	/* a power of 2 */
+	while (shards & (shards - 1))
+		shards &= shards - 1;
+	if ((s = xu_getenv("timer_pool", NULL, 0)) != NULL && atoi(s) > 0)
+		pool = atoi(s);
+	pool = (pool + shards - 1) / shards;
+	r->tick = TIME_TICK;
+	if ((s = xu_getenv("timer_tick", NULL, 0)) != NULL && atoi(s) > 0)
+		r->tick = atoi(s) < TIME_TICK_MIN ? TIME_TICK_MIN : atoi(s);
+	r->rest = 0;
+
+	r->shards = shards;
+	r->wheel = xu_calloc(1, shards * sizeof r->wheel[0]);
+	for (i = 0; i < shards; ++i) {
+		wheel_init(&r->wheel[i], pool);
+	}
 	systime(&r->starttime, &cur);
 	r->current = cur;
 	r->current_point = gettime();
@@ -218,39 +554,97 @@ void xu_timer_init(void)
 
 void xu_updatetime(void)
 {
+	uint64_t diff, cp = gettime();
+	uint32_t ticks;
 	int i;
-	uint32_t diff;
-	uint64_t cp = gettime();
 
 	if (cp < __TM->current_point) {
 		xu_error(NULL, "time diff error: change from %lld to %lld", cp, __TM->current_point);
 		__TM->current_point  = cp;
 	} else if (cp != __TM->current_point) {
-		diff = (uint32_t)(cp - __TM->current_point);
+		diff = cp - __TM->current_point;
 		__TM->current_point = cp;
 		__TM->current += diff;
-	//	printf("diff = %d\n", diff);
-		for (i = 0; i < diff; ++i) {
-			timer_update(__TM);
+		diff += __TM->rest;
+		ticks = (uint32_t)(diff / __TM->tick);
+		__TM->rest = (uint32_t)(diff % __TM->tick);
+		if (ticks == 0)
+			return;
+		for (i = 0; i < __TM->shards; ++i) {
+			timer_update(&__TM->wheel[i], ticks);
 		}
-	//	printf("diff = %d exit\n", diff);
 	}
 }
 
-int xu_timeout(uint32_t handle, int time, int session)
+static void __timeout(uint32_t handle, int64_t us, int64_t slack, int session)
 {
-	if (time <= 0) {
+	int64_t ticks;
+
+	if (us <= 0) {
 		struct xu_actor *ctx = xu_handle_ref(handle);
 		if (ctx) {
-			xu_send(ctx, 0, handle, MTYPE_TIMEOUT | MTYPE_TAG_DONTCOPY | MTYPE_TAG_DASINT, (void *)session, 0);
+			xu_send(ctx, 0, handle, MTYPE_TIMEOUT | MTYPE_TAG_DONTCOPY | MTYPE_TAG_DASINT, (void *)(intptr_t)session, 0);
 			xu_actor_unref(ctx);
 		}
-	} else {
-		struct timer_event evt;
-		evt.handle = handle;
-		evt.session = session;
-		timer_add(__TM, &evt, sizeof evt, time);
+		return;
 	}
+	/* never early, a partial tick counts as a whole one */
+	ticks = (us + __TM->tick - 1) / __TM->tick;
+	slack = slack > 0 ? slack / __TM->tick : 0;
+	timer_add(__wheel(handle), handle, session, ticks > INT32_MAX ? INT32_MAX : (int)ticks,
+		slack > INT32_MAX ? INT32_MAX : (uint32_t)slack);
+}
+
+int xu_timeout(uint32_t handle, int time, int session)
+{
+	__timeout(handle, (int64_t)time * 1000, 0, session);
+	return session;
+}
+
+int xu_timeout_slack(uint32_t handle, int time, int slack, int session)
+{
+	__timeout(handle, (int64_t)time * 1000, (int64_t)slack * 1000, session);
+	return session;
+}
+
+int xu_timeout_us(uint32_t handle, int64_t time, int session)
+{
+	__timeout(handle, time, 0, session);
 	return session;
 }
 
+int xu_timeout_cancel(uint32_t handle, int session)
+{
+	struct timer *T = __wheel(handle);
+	struct timer_node *node;
+	int r = 0;
+
+	SPIN_LOCK(T);
+	if ((node = index_find(T, handle, session)) != NULL) {
+		unlink(node);
+		index_remove(T, node);
+		node_put(T, node, node, 1);
+		r = 1;
+	}
+	SPIN_UNLOCK(T);
+
+	return r;
+}
+
+void xu_timer_stat(struct xu_timer_stat *st)
+{
+	struct timer *T;
+	int i;
+
+	memset(st, 0, sizeof *st);
+	for (i = 0; i < __TM->shards; ++i) {
+		T = &__TM->wheel[i];
+		SPIN_LOCK(T);
+		st->live  += T->index_count;
+		st->pool  += T->pool_size;
+		st->free  += T->pool_free;
+		st->grows += T->chunks;
+		SPIN_UNLOCK(T);
+	}
+}
+
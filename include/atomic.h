@@ -14,6 +14,8 @@ extern "C" {
 #define ATOM_ADD(ptr,n)                   __sync_add_and_fetch(ptr, n)
 #define ATOM_SUB(ptr,n)                   __sync_sub_and_fetch(ptr, n)
 #define ATOM_AND(ptr,n)                   __sync_and_and_fetch(ptr, n)
+#define ATOM_LOAD_ACQUIRE(ptr)            __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define ATOM_STORE_RELEASE(ptr, v)        __atomic_store_n(ptr, v, __ATOMIC_RELEASE)
 
 #ifdef __cplusplus
 }
@@ -12,6 +12,7 @@
 #define XIE_EVENT_CLOSE      7
 #define XIE_EVENT_DRAIN      8
 #define XIE_EVENT_PEERADDR   9
+#define XIE_EVENT_MESSAGES   10 /* UDP batch, see xu_io_dgram */
 
 #define XIE_ERR_SUCC      0
 #define XIE_ERR_DNS       1
@@ -40,13 +41,28 @@ struct xu_io_event {
 	char data[0];
 };
 
+/*
+ * XIE_EVENT_MESSAGES data is a run of these, each XU_IO_DGRAM_SIZE(len)
+ * long, `size' bytes in all; u.errcode is the number of datagrams.
+ */
+struct xu_io_dgram {
+	union sockaddr_all addr;
+	uint32_t len;
+	char data[0];
+};
+
+#define XU_IO_DGRAM_SIZE(len) ((sizeof(struct xu_io_dgram) + (len) + 7) & ~(size_t)7)
+
 uint32_t xu_io_tcp_server(uint32_t handle, const char *addr, int port);
 uint32_t xu_io_tcp_connect(uint32_t handle, const char *addr, int port);
 int xu_io_tcp_nodelay(uint32_t handle, uint32_t fdesc, int on);
 int xu_io_tcp_keepalive(uint32_t handle, uint32_t fdesc, int enable, int delay);
+int xu_io_tcp_cork(uint32_t handle, uint32_t fdesc, int on);
 
 uint32_t xu_io_fd_open(uint32_t handle, int fd);
 int xu_io_write(uint32_t handle, uint32_t fdesc, const void *data, int len);
+/* `data' from xu_malloc, the IO thread frees it once written */
+int xu_io_write_owned(uint32_t handle, uint32_t fdesc, void *data, int len);
 
 int xu_io_close(uint32_t handle, uint32_t fdesc);
 
@@ -54,11 +70,17 @@ uint32_t xu_io_udp_server(uint32_t handle, const char *addr, int port);
 uint32_t xu_io_udp_open(uint32_t handle, int udp6);
 
 int xu_io_udp_send(uint32_t handle, uint32_t fdesc, union sockaddr_all *, const void *data, int len);
+int xu_io_udp_send_owned(uint32_t handle, uint32_t fdesc, union sockaddr_all *, void *data, int len);
 int xu_io_udp_membership(uint32_t handle, uint32_t fdesc, const char *mcast, const char *iaddr, int join);
 int xu_io_udp_set_multicast_loop(uint32_t handle, uint32_t fdesc, int on);
 int xu_io_udp_set_broadcast(uint32_t handle, uint32_t fdesc, int on);
 int xu_io_udp_set_ttl(uint32_t handle, uint32_t fd, int on);
 int xu_io_udp_set_multicast_ttl(uint32_t handle, uint32_t fd, int on);
+/*
+ * batched receive and send for datagrams up to `dgram_max', 0 turns it off;
+ * a receive batch takes 64 KB at most, so fewer datagrams when they are big.
+ */
+int xu_io_udp_set_batch(uint32_t handle, uint32_t fdesc, int dgram_max);
 
 #endif
 
@@ -11,18 +11,33 @@ extern "C"
 
 #define MTYPE_TAG_DONTCOPY 0x10000
 #define MTYPE_TAG_DASINT   0x20000
+#define MTYPE_TAG_SHARED   0x40000 /* refcounted payload, see xu_send_group */
 
 #define MTYPE_TIMEOUT 1
 #define MTYPE_LOG     2
 #define MTYPE_IO      3
+#define MTYPE_OVERLOAD 4 /* struct xu_overload */
+#define MTYPE_TIMEOUTS 5 /* int sessions[size / sizeof (int)] */
 
 #define XU_NAME_LEN (64)
 
+/*
+ * Copied payloads up to the inline threshold (env `inline', at most
+ * XU_MSG_INLINE_MAX bytes) travel inside the mailbox slot, `size' has
+ * MSIZE_INLINE set and `data' is unused.  The receiver's callback gets a
+ * pointer into the slot which is only valid during the call, returning
+ * non zero doesn't keep it: a receiver keeping a copied payload must copy
+ * it.  MTYPE_TAG_DONTCOPY and MTYPE_TAG_SHARED payloads are never inline.
+ */
+#define XU_MSG_INLINE_MAX (64)
+#define MSIZE_INLINE      ((size_t)1 << (sizeof (size_t) * 8 - 1))
+
 struct xu_msg {
 	uint32_t    source;
 	int         type;
-	size_t      size; /* type | size */
+	size_t      size; /* size | MSIZE_INLINE */
 	const void *data;
+	char        inl[XU_MSG_INLINE_MAX];
 };
 
 #define container_of(ptr, type, member) ({              \
@@ -58,6 +73,12 @@ void xu_kern_exit(void);
 typedef int (*xu_callback_t)(struct xu_actor *, void *ud, int type, uint32_t src, void *msg, size_t sz);
 
 void xu_actor_callback(struct xu_actor *ctx, void *ud, xu_callback_t cb);
+/*
+ * Timeouts of the actor expiring in the same tick come as one
+ * MTYPE_TIMEOUTS message carrying their sessions instead of one
+ * MTYPE_TIMEOUT message each.
+ */
+void xu_actor_batch_timeouts(struct xu_actor *ctx, int on);
 
 int xu_handle_retire(uint32_t handle);
 struct xu_actor *xu_handle_ref(uint32_t handle);
@@ -65,16 +86,66 @@ struct xu_actor *xu_actor_unref(struct xu_actor *ctx);
 
 struct xu_actor *xu_actor_new(const char *name, const char *p);
 int xu_handle_msgput(uint32_t handle, struct xu_msg *msg);
+/*
+ * return: 0 if queued (or dropped by a drop-* policy), -1 bad or too
+ * large message, -2 no such actor, -3 mailbox full (reject policy).
+ * The payload is released on failure if the kernel owns it.
+ */
 int xu_send(struct xu_actor *ctx, uint32_t src, uint32_t dest, int type, void *msg, size_t sz);
 int xu_sendname(struct xu_actor * context, uint32_t source, const char *addr , int type, void * data, size_t sz);
 
+/*
+ * Send one payload to n actors without copying it.
+ *
+ * msg must come from xu_msg_alloc, every receiver gets a reference to it
+ * (MTYPE_TAG_SHARED) and must treat it as read only, the caller's own
+ * reference is consumed.  return: the number of actors reached.
+ */
+int xu_send_group(struct xu_actor *ctx, const uint32_t *handles, int n, int type, void *msg, size_t sz);
+
 struct queue *xu_dispatch_message(struct queue *q, int weight);
 uint32_t xu_actor_findname(const char *name);
+
+/*
+ * A caller owned cache entry of a resolved name, it is refreshed when
+ * the name registry changed since (zero it before the first use).
+ */
+struct xu_name_cache {
+	uint32_t gen;
+	uint32_t handle;
+	char name[XU_NAME_LEN + 1];
+};
+
+uint32_t xu_actor_findname_cached(struct xu_name_cache *c, const char *name);
 const char *xu_actor_namehandle(uint32_t h, const char *name);
 uint32_t xu_actor_handle(struct xu_actor *);
 
 int xu_actor_name(struct xu_actor *ctx, char *buf, int len);
 
+/*
+ * Mailbox limits.
+ *
+ * A bounded mailbox holding `cap' messages applies its policy to new
+ * ones.  The first overflow after the mailbox drained below half of its
+ * capacity sends MTYPE_OVERLOAD to the sender and to the supervisor (the
+ * given handle, else env `supervisor', a name or ":handle").  Defaults
+ * come from env `mailbox.<module>' or `mailbox': "capacity[,policy]".
+ */
+#define XU_MAILBOX_REJECT      0 /* xu_send returns -3 */
+#define XU_MAILBOX_DROP_NEWEST 1
+#define XU_MAILBOX_DROP_OLDEST 2
+
+struct xu_overload {
+	uint32_t handle; /* the overloaded actor */
+	int      cap;
+	int      policy;
+};
+
+/* cap <= 0: unbounded. */
+int xu_actor_mailbox(uint32_t handle, int cap, int policy, uint32_t supervisor);
+/* "reject", "drop-newest", "drop-oldest", -1 if unknown. */
+int xu_mailbox_policy(const char *s);
+
 /*
  * Iterate for each actors.
  */
@@ -88,6 +159,36 @@ void xu_actors_foreach(void *ud, int (*f)(void *ud, struct xu_actor *));
 int xu_actor_logon(struct xu_actor *ctx, const char *p);
 void xu_actor_logoff(struct xu_actor *ctx);
 
+/*
+ * Message payload allocator.
+ *
+ * Payloads sent with MTYPE_TAG_DONTCOPY must come from xu_msg_alloc,
+ * the kernel releases them with xu_msg_free after the receiver's callback
+ * (unless the callback returns non zero, then the receiver owns it).  Not
+ * so for a copied payload, it may be inline, see MSIZE_INLINE.
+ * Sizes up to XU_MPOOL_MAX are served from per thread caches.
+ */
+#define XU_MPOOL_MAX (256)
+
+struct xu_msg_stat {
+	uint64_t alloc;  /* allocations */
+	uint64_t hit;    /* served from a cache */
+	uint64_t large;  /* bigger than XU_MPOOL_MAX */
+	size_t   cached; /* bytes held by the caches */
+};
+
+void *xu_msg_alloc(size_t sz);
+/* drop one reference, the payload is released with the last one. */
+void xu_msg_free(void *p);
+/* add n references to a payload. */
+void *xu_msg_retain(void *p, int n);
+/*
+ * Give back the memory past `sz' bytes of an unshared payload bigger
+ * than XU_MPOOL_MAX, may move it.  Smaller ones are left as they are.
+ */
+void *xu_msg_shrink(void *p, size_t sz);
+void xu_msg_stat(struct xu_msg_stat *st);
+
 /*
  * print msg to logger actor.
  */
@@ -97,7 +198,33 @@ void xu_error(struct xu_actor * context, const char *msg, ...);
  * time api.
  */
 uint64_t xu_now(void);
+/* monotonic time since start in us, as fine as the timer tick */
+uint64_t xu_now_us(void);
 int xu_timeout(uint32_t handle, int time, int session);
+/*
+ * Same as xu_timeout, `time' in us.  Rounded up to the timer tick,
+ * env `timer_tick' (us, default 1000).
+ */
+int xu_timeout_us(uint32_t handle, int64_t time, int session);
+/*
+ * Same as xu_timeout, may fire up to `slack' ms late so that timeouts
+ * with a similar slack are aligned and expire together.
+ */
+int xu_timeout_slack(uint32_t handle, int time, int slack, int session);
+/*
+ * Cancel a pending timeout of handle.
+ * return: 1 if cancelled, 0 if it already fired (or never existed).
+ */
+int xu_timeout_cancel(uint32_t handle, int session);
+
+struct xu_timer_stat {
+	uint32_t live;  /* pending timeouts */
+	uint32_t pool;  /* timer nodes allocated, env `timer_pool' at start */
+	uint32_t free;  /* nodes in the pool */
+	uint32_t grows; /* times the pool grew */
+};
+
+void xu_timer_stat(struct xu_timer_stat *st);
 
 /*
  * environments api.
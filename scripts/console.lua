@@ -38,6 +38,13 @@ function handle_cmd(c, line)
 		if s ~= nil and s:len() > 0 then
 			con:write(s .. "\r\n")
 		end
+	elseif fields[1] == "stat" then
+		local m = actor.msgstat()
+		local t = actor.timerstat()
+		con:write(string.format("msg: alloc %d hit %d large %d cached %d\r\n",
+			m.alloc, m.hit, m.large, m.cached))
+		con:write(string.format("timer: live %d pool %d free %d grows %d\r\n",
+			t.live, t.pool, t.free, t.grows))
 	elseif fields[1] == "error" and fields[2] ~= nil then
 		actor.error(table.concat(fields, " " , 2))
 	else 
@@ -4,7 +4,9 @@ local M = {
 	type = {
 		MTYPE_TIMEOUT = 1,
 		MTYPE_LOG = 2,
-		MTYPE_IO = 3
+		MTYPE_IO = 3,
+		MTYPE_OVERLOAD = 4,
+		MTYPE_TIMEOUTS = 5
 	}
 }
 
@@ -14,6 +14,10 @@ function S:write(s)
 	return sio.write(self._fd, s)
 end
 
+function S:cork(on)
+	sio.cork(self._fd, on)
+end
+
 function S:close()
 	local r =  sio.close(self._fd)
 	__conns[self._fd] = nil
@@ -1,6 +1,23 @@
 require("class")
+local heap = require("tmheap")
 local T = class()
-local M = {idx = 1, timers = {}}
+-- the actor's timers are kept in a heap, one kernel timeout is armed for
+-- the nearest deadline.  Its sessions are negative, apart from the ones
+-- given to actor.timeout directly.
+local M = {idx = 1, timers = {}, heap = nil, armed = nil, ksession = 0}
+
+local function __arm()
+	local deadline, session = M.heap:top()
+	if deadline == nil or (M.armed ~= nil and M.armed <= deadline) then
+		return
+	end
+	if M.armed ~= nil then
+		actor.cancel(M.ksession)
+	end
+	M.ksession = M.ksession - 1
+	M.armed = deadline
+	actor.timeout(math.max(deadline - actor.now(), 1), M.ksession, M.timers[session].slack)
+end
 
 function T:constructor(p, f, ms, arg)
 	local i = M.idx
@@ -10,23 +27,56 @@ function T:constructor(p, f, ms, arg)
 	self.periodic = p
 	self.callback = f
 	self.params = arg
-	actor.timeout(self.delay, i)
+	self.slack = 0
 	M.timers[i] = self
+	self.ref = M.heap:push(actor.now() + ms, i)
+	__arm()
+end
+
+-- run every due timer, then re-arm the periodic ones
+local function __expire()
+	local now = actor.now()
+	local again = {}
+
+	M.armed = nil
+	while true do
+		-- only the due ones, slack delays the kernel timeout, never advances
+		local session = M.heap:pop(now)
+		if session == nil then
+			break
+		end
+		local tm = M.timers[session]
+		tm.ref = nil
+		local f = tm.callback
+		f(table.unpack(tm.params))
+		-- the callback may have cancelled or rescheduled it
+		if tm.ref ~= nil or M.timers[session] ~= tm then
+		elseif tm.periodic then
+			again[#again + 1] = tm
+		else
+			M.timers[session] = nil
+		end
+	end
+	now = actor.now()
+	for _, tm in ipairs(again) do
+		tm.ref = M.heap:push(now + tm.delay, tm.session)
+	end
+	__arm()
 end
 
 local function __do_timeout(src, session, len)
 	if len ~= 0 then
 		actor.error("Maybe a bug: not a timeout message")
-	else
-		local tm = M.timers[session]
-		if tm ~= nil then
-			f = tm.callback
-			f(table.unpack(tm.params))
-			if tm.periodic then
-				actor.timeout(tm.delay, session)
-			else
-				M.timers[session] = nil
-			end
+	elseif session == M.ksession then
+		__expire()
+	end
+end
+
+-- sessions of the timeouts expired together, an array of int
+local function __do_timeouts(src, msg, len)
+	for off = 0, len - 4, 4 do
+		if rdbuf.read32(msg, off) == M.ksession then
+			__expire()
 		end
 	end
 end
@@ -35,6 +85,36 @@ function T:setTimeout(ms)
 	self.delay = ms
 end
 
+-- may fire up to `ms' late, along with other timers of the same slack
+function T:setSlack(ms)
+	self.slack = ms
+	return self
+end
+
+-- fire `ms' from now instead, the delay of an interval is kept
+function T:reschedule(ms)
+	if M.timers[self.session] ~= self then
+		return
+	end
+	local deadline = actor.now() + ms
+	if self.ref == nil then
+		self.ref = M.heap:push(deadline, self.session)
+	else
+		M.heap:update(self.ref, deadline)
+	end
+	__arm()
+end
+
+function T:cancel()
+	if M.timers[self.session] == self then
+		M.timers[self.session] = nil
+		if self.ref ~= nil then
+			M.heap:remove(self.ref)
+			self.ref = nil
+		end
+	end
+end
+
 function M.timeout(f, ms, ...)
 	if f == nil then
 		actor.error("BUG: please specify callback function")
@@ -55,7 +135,10 @@ end
 
 function M.init()
 	local c = require("core")
+	M.heap = heap.new()
 	c.register(c.type.MTYPE_TIMEOUT, __do_timeout)
+	c.register(c.type.MTYPE_TIMEOUTS, __do_timeouts)
+	actor.batchtimeouts(true)
 end
 
 return M
@@ -65,7 +65,7 @@ function dispatch(msgtype, src, msg, sz)
 end
 
 actor.callback(dispatch)
-actor.error("threads: " .. os.getenv("UV_THREADPOOL_SIZE"))
+actor.error("threads: " .. (actor.getenv("threads") or "default"))
 --actor.launch("xulua", "tty /dev/ttyS1")
 --actor.launch("xulua", "tty sl0")
 
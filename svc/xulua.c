@@ -19,6 +19,19 @@ struct xulua {
 #define SOCK_MTADDR  "mt.SockAddr"
 #define SOCKADDR(x)  (luaL_checkudata(L, (x), SOCK_MTADDR))
 
+#define WRBUF_MTCLASS "mt.WrBuf"
+#define WRBUF(x)     (luaL_checkudata(L, (x), WRBUF_MTCLASS))
+
+/*
+ * Write buffer, its data is a xu_malloc block handed to the IO thread
+ * by sio.write / sio.udpSend, which leaves the buffer empty.
+ */
+struct wrbuf {
+	char  *data;
+	size_t len;
+	size_t cap;
+};
+
 static int __sock_port(lua_State *L)
 {
 	union sockaddr_all *sa = SOCKADDR(1);
@@ -143,11 +156,40 @@ static int __xie_get_address(lua_State *L)
 	return 1;
 }
 
+/* for next, data, address in ioevent.dgrams(msg) of a XIE_EVENT_MESSAGES */
+static int __xie_dgram_next(lua_State *L)
+{
+	struct xu_io_event *xie = lua_touserdata(L, 1);
+	size_t off = luaL_checkinteger(L, 2);
+	struct xu_io_dgram *dg;
+	union sockaddr_all *p;
+
+	if (off >= xie->size)
+		return 0;
+	dg = (struct xu_io_dgram *)(xie->data + off);
+	lua_pushinteger(L, off + XU_IO_DGRAM_SIZE(dg->len));
+	lua_pushlstring(L, dg->data, dg->len);
+	p = lua_newuserdata(L, sizeof *p);
+	*p = dg->addr;
+	luaL_getmetatable(L, SOCK_MTADDR);
+	lua_setmetatable(L, -2);
+	return 3;
+}
+
+static int __xie_dgrams(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	lua_pushcfunction(L, __xie_dgram_next);
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, 0);
+	return 3;
+}
+
 static int __xie_free(lua_State *L)
 {
 	struct xu_io_event *xie = lua_touserdata(L, 1);
 
-	xu_free(xie);
+	xu_msg_free(xie);
 	return 0;
 }
 
@@ -177,6 +219,7 @@ static void __xio_event(lua_State *L)
 		{"tostring", __xie_tostring},
 		{"data",     __xie_get_data},
 		{"address",  __xie_get_address},
+		{"dgrams",   __xie_dgrams},
 		{"free",     __xie_free},
 		{NULL, NULL}
 	};
@@ -259,6 +302,145 @@ static void __xio_buffer(lua_State *L)
 	lua_pop(L, 1);
 }
 
+static char *__wrbuf_reserve(struct wrbuf *b, size_t n)
+{
+	size_t cap = b->cap ? b->cap : 64;
+
+	if (b->len + n > b->cap) {
+		while (cap < b->len + n)
+			cap *= 2;
+		b->data = xu_realloc(b->data, cap);
+		b->cap = cap;
+	}
+	b->len += n;
+	return b->data + b->len - n;
+}
+
+static int __wrbuf_new(lua_State *L)
+{
+	size_t cap = luaL_optinteger(L, 1, 0);
+	struct wrbuf *b = lua_newuserdata(L, sizeof *b);
+
+	b->data = NULL;
+	b->len = b->cap = 0;
+	luaL_getmetatable(L, WRBUF_MTCLASS);
+	lua_setmetatable(L, -2);
+	if (cap > 0) {
+		__wrbuf_reserve(b, cap);
+		b->len = 0;
+	}
+	return 1;
+}
+
+/* b:append(string | lightuserdata, [len]) */
+static int __wrbuf_append(lua_State *L)
+{
+	struct wrbuf *b = WRBUF(1);
+	const void *p;
+	size_t len;
+
+	if (lua_type(L, 2) == LUA_TLIGHTUSERDATA) {
+		p = lua_touserdata(L, 2);
+		len = luaL_checkinteger(L, 3);
+	} else {
+		p = luaL_checklstring(L, 2, &len);
+	}
+	if (len > 0)
+		memcpy(__wrbuf_reserve(b, len), p, len);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int __wrbuf_write_u8(lua_State *L)
+{
+	struct wrbuf *b = WRBUF(1);
+	uint8_t v = luaL_checkinteger(L, 2);
+
+	memcpy(__wrbuf_reserve(b, sizeof v), &v, sizeof v);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int __wrbuf_write_u16(lua_State *L)
+{
+	struct wrbuf *b = WRBUF(1);
+	uint16_t v = luaL_checkinteger(L, 2);
+
+	memcpy(__wrbuf_reserve(b, sizeof v), &v, sizeof v);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int __wrbuf_write_u32(lua_State *L)
+{
+	struct wrbuf *b = WRBUF(1);
+	uint32_t v = luaL_checkinteger(L, 2);
+
+	memcpy(__wrbuf_reserve(b, sizeof v), &v, sizeof v);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int __wrbuf_len(lua_State *L)
+{
+	struct wrbuf *b = WRBUF(1);
+
+	lua_pushinteger(L, b->len);
+	return 1;
+}
+
+static int __wrbuf_tostring(lua_State *L)
+{
+	struct wrbuf *b = WRBUF(1);
+
+	lua_pushlstring(L, b->len ? b->data : "", b->len);
+	return 1;
+}
+
+static int __wrbuf_gc(lua_State *L)
+{
+	struct wrbuf *b = WRBUF(1);
+
+	xu_free(b->data);
+	b->data = NULL;
+	b->len = b->cap = 0;
+	return 0;
+}
+
+/* hand the data over, the buffer is empty after */
+static void *__wrbuf_take(struct wrbuf *b, size_t *len)
+{
+	void *p = b->data;
+
+	*len = b->len;
+	b->data = NULL;
+	b->len = b->cap = 0;
+	return p;
+}
+
+static void __xio_wrbuf(lua_State *L)
+{
+	luaL_Reg mt[] = {
+		{"append",   __wrbuf_append},
+		{"writeu8",  __wrbuf_write_u8},
+		{"writeu16", __wrbuf_write_u16},
+		{"writeu32", __wrbuf_write_u32},
+		{"len",      __wrbuf_len},
+		{"__len",    __wrbuf_len},
+		{"tostring", __wrbuf_tostring},
+		{"__gc",     __wrbuf_gc},
+		{NULL, NULL}
+	};
+	luaL_Reg xb[] = {
+		{"new", __wrbuf_new},
+		{NULL, NULL}
+	};
+
+	create_metatable(L, WRBUF_MTCLASS, mt);
+	luaL_openlib(L, "wrbuf", xb, 0);
+	lua_pop(L, 1);
+}
+
 static void * __alloc(void *ud, void *ptr, size_t osize, size_t nsize)
 {
 	if (nsize == 0) {
@@ -367,15 +549,15 @@ static int lquery(lua_State *L)
 
 	if (top >= 1) {
 		h = luaL_checkinteger(L, 1);
-		ctx = xu_handle_ref(h);
-	} 
-
-	if (ctx) {
+		if ((ctx = xu_handle_ref(h)) == NULL)
+			return 0;
+		xu_actor_name(ctx, name, sizeof name);
+		xu_actor_unref(ctx);
+	} else {
 		xu_actor_name(ctx, name, sizeof name);
-		lua_pushstring(L, name);
-		return 1;
 	}
-	return 0;
+	lua_pushstring(L, name);
+	return 1;
 }
 
 static int ltimeout(lua_State *L)
@@ -386,10 +568,48 @@ static int ltimeout(lua_State *L)
 
 	tmo = luaL_checkinteger(L, 1);
 	session = luaL_checkinteger(L, 2);
-	xu_timeout(xu_actor_handle(ctx), tmo, session);
+	xu_timeout_slack(xu_actor_handle(ctx), tmo, luaL_optinteger(L, 3, 0), session);
+	return 0;
+}
+
+/*
+ * actor.timeoutus(us, session)
+ */
+static int ltimeoutus(lua_State *L)
+{
+	struct xu_actor *ctx = lua_touserdata(L, lua_upvalueindex(1));
+	lua_Integer tmo = luaL_checkinteger(L, 1);
+	int session = luaL_checkinteger(L, 2);
+
+	xu_timeout_us(xu_actor_handle(ctx), tmo, session);
+	return 0;
+}
+
+/*
+ * actor.batchtimeouts(on)
+ *  timeouts expiring together come as one MTYPE_TIMEOUTS message.
+ */
+static int lbatchtimeouts(lua_State *L)
+{
+	struct xu_actor *ctx = lua_touserdata(L, lua_upvalueindex(1));
+
+	xu_actor_batch_timeouts(ctx, lua_toboolean(L, 1));
 	return 0;
 }
 
+/*
+ * actor.cancel(session)
+ *  return: true if the timeout was pending.
+ */
+static int lcancel(lua_State *L)
+{
+	struct xu_actor *ctx = lua_touserdata(L, lua_upvalueindex(1));
+	int session = luaL_checkinteger(L, 1);
+
+	lua_pushboolean(L, xu_timeout_cancel(xu_actor_handle(ctx), session));
+	return 1;
+}
+
 /* 
  * xu_send wrapper.
  *
@@ -398,6 +618,8 @@ static int ltimeout(lua_State *L)
  * <3> : type `int'.
  * <4> : msg (lightuserdata or string).
  * <5> : size or nil.
+ *
+ * return: the xu_send result, -3 if the mailbox is full.
  */
 static int lsend(lua_State *L)
 {
@@ -408,10 +630,12 @@ static int lsend(lua_State *L)
 	void *msg;
 	size_t len = 0;
 
-	if ((dst = luaL_checkinteger(L, 1)) == 0) {
-		if (lua_type(L, 1) == LUA_TNUMBER) {
+	if (lua_type(L, 1) == LUA_TNUMBER) {
+		if ((dst = lua_tointeger(L, 1)) == 0) {
 			return luaL_error(L, "Invalid dest address 0");
 		}
+	} else {
+		dst = 0;
 		dstring = lua_tostring(L, 1);
 		if (dstring == NULL) {
 			return luaL_error(L, "dest address type (%s) must be string or number", lua_typename(L, lua_type(L, 1)));
@@ -435,12 +659,14 @@ static int lsend(lua_State *L)
 			luaL_error(L, "invalid param %s", lua_typename(L, lua_type(L, 4)));
 			break;
 	}
+	int r;
 	if (dstring) {
-		xu_sendname(ctx, source, dstring, type, msg, len);
+		r = xu_sendname(ctx, source, dstring, type, msg, len);
 	} else {
-		xu_send(ctx, source, dst, type, msg, len);
+		r = xu_send(ctx, source, dst, type, msg, len);
 	}
-	return 0;
+	lua_pushinteger(L, r);
+	return 1;
 }
 
 static int lnow(lua_State *L)
@@ -450,6 +676,46 @@ static int lnow(lua_State *L)
 	return 1;
 }
 
+static int lnowus(lua_State *L)
+{
+	lua_pushinteger(L, xu_now_us());
+	return 1;
+}
+
+static int lmsgstat(lua_State *L)
+{
+	struct xu_msg_stat st;
+
+	xu_msg_stat(&st);
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, st.alloc);
+	lua_setfield(L, -2, "alloc");
+	lua_pushinteger(L, st.hit);
+	lua_setfield(L, -2, "hit");
+	lua_pushinteger(L, st.large);
+	lua_setfield(L, -2, "large");
+	lua_pushinteger(L, st.cached);
+	lua_setfield(L, -2, "cached");
+	return 1;
+}
+
+static int ltimerstat(lua_State *L)
+{
+	struct xu_timer_stat st;
+
+	xu_timer_stat(&st);
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, st.live);
+	lua_setfield(L, -2, "live");
+	lua_pushinteger(L, st.pool);
+	lua_setfield(L, -2, "pool");
+	lua_pushinteger(L, st.free);
+	lua_setfield(L, -2, "free");
+	lua_pushinteger(L, st.grows);
+	lua_setfield(L, -2, "grows");
+	return 1;
+}
+
 #define STYPE_TCP 1
 #define STYPE_UDP 2
 #define STYPE_CON 3
@@ -523,6 +789,11 @@ static int lwrite(lua_State *L)
 			msg = lua_touserdata(L, 2);
 			len = luaL_checkinteger(L, 3);
 			break;
+		case LUA_TUSERDATA:
+			msg = __wrbuf_take(WRBUF(2), &len);
+			if (msg)
+				xu_io_write_owned(owner, fd, msg, len);
+			return 0;
 		default:
 			return luaL_error(L, "write invalid param %s", lua_typename(L, lua_type(L, 2)));
 	}
@@ -545,14 +816,18 @@ static int ludpsend(lua_State *L)
 	int mtype = lua_type(L, 3);
 	switch (mtype) {
 		case LUA_TSTRING:
-			msg = (void *)lua_tolstring(L, 2, &len);
+			msg = (void *)lua_tolstring(L, 3, &len);
 			break;
 		case LUA_TLIGHTUSERDATA:
-			msg = lua_touserdata(L, 2);
-			len = luaL_checkinteger(L, 3);
+			msg = lua_touserdata(L, 3);
+			len = luaL_checkinteger(L, 4);
 			break;
+		case LUA_TUSERDATA:
+			msg = __wrbuf_take(WRBUF(3), &len);
+			xu_io_udp_send_owned(owner, fd, sa, msg, len);
+			return 0;
 		default:
-			return luaL_error(L, "write invalid param %s", lua_typename(L, lua_type(L, 2)));
+			return luaL_error(L, "write invalid param %s", lua_typename(L, lua_type(L, 3)));
 	}
 
 	xu_io_udp_send(owner, fd, sa, msg, len);
@@ -648,6 +923,28 @@ static int llaunch(lua_State *L)
 	return 1;
 }
 
+/*
+ * actor.mailbox(handle, capacity [, policy [, supervisor]])
+ *  handle: 0 for self.
+ *  policy: "reject" (default), "drop-newest" or "drop-oldest".
+ */
+static int lmailbox(lua_State *L)
+{
+	struct xu_actor *ctx = lua_touserdata(L, lua_upvalueindex(1));
+	uint32_t h = luaL_checkinteger(L, 1);
+	int cap = luaL_checkinteger(L, 2);
+	const char *p = luaL_optstring(L, 3, "reject");
+	uint32_t sup = luaL_optinteger(L, 4, 0);
+	int policy;
+
+	if ((policy = xu_mailbox_policy(p)) < 0)
+		return luaL_error(L, "unknown mailbox policy %s", p);
+	if (h == 0)
+		h = xu_actor_handle(ctx);
+	lua_pushboolean(L, xu_actor_mailbox(h, cap, policy, sup) == 0);
+	return 1;
+}
+
 static int lgetenv(lua_State *L)
 {
 	char buf[128] = {0};
@@ -787,6 +1084,39 @@ static int lkeepalive(lua_State *L)
 	return 0;
 }
 
+/*
+ * sio.setBatch(fd, size | enable)
+ *  batched UDP for datagrams up to size bytes (2048 if true), false
+ *  turns it off.  A receive reads up to 32 datagrams, fewer when they
+ *  are big: a batch buffer holds no more than 64 KB of slots.
+ */
+static int lbatch(lua_State *L)
+{
+	struct xu_actor *ctx = lua_touserdata(L, lua_upvalueindex(1));
+	uint32_t fdesc;
+	int max = 0;
+
+	fdesc = luaL_checkinteger(L, 1);
+	if (lua_type(L, 2) == LUA_TNUMBER)
+		max = lua_tointeger(L, 2);
+	else if (lua_toboolean(L, 2))
+		max = 2048;
+	xu_io_udp_set_batch(xu_actor_handle(ctx), fdesc, max);
+	return 0;
+}
+
+static int lcork(lua_State *L)
+{
+	struct xu_actor *ctx = lua_touserdata(L, lua_upvalueindex(1));
+	uint32_t fdesc;
+	int on;
+
+	fdesc = luaL_checkinteger(L, 1);
+	on = lua_toboolean(L, 2);
+	xu_io_tcp_cork(xu_actor_handle(ctx), fdesc, on);
+	return 0;
+}
+
 static int llogon(lua_State *L)
 {
 	const char *file = NULL; 
@@ -820,8 +1150,12 @@ static int __init_cb(struct xu_actor *ctx, void *ud, int mtype, uint32_t src, vo
 		{"name",     lsetname},
 		{"query",    lquery},
 		{"timeout",  ltimeout},
+		{"timeoutus", ltimeoutus},
+		{"cancel",   lcancel},
+		{"batchtimeouts", lbatchtimeouts},
 		{"dispatch",     lsend},
 		{"launch",   llaunch},
+		{"mailbox",  lmailbox},
 		{"logon",    llogon},
 		{"logoff",   llogoff},
 		{"exit",     lexit},
@@ -829,6 +1163,9 @@ static int __init_cb(struct xu_actor *ctx, void *ud, int mtype, uint32_t src, vo
 		{"getenv",   lgetenv},
 		{"setenv",   lsetenv},
 		{"now",      lnow},
+		{"nowus",    lnowus},
+		{"msgstat",  lmsgstat},
+		{"timerstat", ltimerstat},
 		{"error",    lerror},
 		{NULL, NULL}
 	};
@@ -845,6 +1182,8 @@ static int __init_cb(struct xu_actor *ctx, void *ud, int mtype, uint32_t src, vo
 		{"setMulticastLoopback", lmulticastloop},
 		{"setBroadcast", lbroadcast},
 		{"setKeepalive", lkeepalive},
+		{"cork", lcork},
+		{"setBatch", lbatch},
 		{"udpPeer", ludppeer},
 		{"address", ludpaddress},
 		{NULL, NULL}
@@ -867,6 +1206,7 @@ static int __init_cb(struct xu_actor *ctx, void *ud, int mtype, uint32_t src, vo
 	__sock_addr_mt(L);
 	__xio_event(L);
 	__xio_buffer(L);
+	__xio_wrbuf(L);
 
 	if ((loader = xu_getenv("lua_loader", NULL, 0)) == NULL)
 		loader = "./scripts/loader.lua";
@@ -0,0 +1,126 @@
+/*
+ * Handle table lookup benchmark.
+ *
+ * N threads resolve handles with xu_handle_ref/xu_actor_unref, compared
+ * with the old rwlock protected table.  Actors are `logger' instances
+ * loaded from the module path.
+ *
+ * usage: bench_handle [lookups per thread] [module path]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "xu_impl.h"
+#include "xu_kern.h"
+
+#define MAX_THREADS 8
+#define ACTORS      64
+
+/* the old read path: rwlock, slot lookup and a reference */
+struct legacy {
+	struct rwlock lock;
+	uint32_t handle[ACTORS];
+	int ref[ACTORS];
+};
+
+static int legacy_ref(struct legacy *l, uint32_t h)
+{
+	int hash = h & (ACTORS - 1), r = -1;
+
+	rwlock_rlock(&l->lock);
+	if (l->handle[hash] == h) {
+		ATOM_INC(&l->ref[hash]);
+		r = hash;
+	}
+	rwlock_runlock(&l->lock);
+	return r;
+}
+
+struct bench {
+	int legacy;
+	long count;
+	uint32_t handle[ACTORS];
+	struct legacy l;
+	volatile int start;
+};
+
+static void *lookup(void *ud)
+{
+	struct bench *b = ud;
+	struct xu_actor *ctx;
+	long i;
+	int r;
+
+	while (!b->start)
+		sched_yield();
+	for (i = 0; i < b->count; ++i) {
+		uint32_t h = b->handle[i & (ACTORS - 1)];
+		if (b->legacy) {
+			if ((r = legacy_ref(&b->l, h)) >= 0)
+				ATOM_DEC(&b->l.ref[r]);
+		} else if ((ctx = xu_handle_ref(h)) != NULL) {
+			xu_actor_unref(ctx);
+		}
+	}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(struct bench *b, int legacy, int threads)
+{
+	pthread_t tid[MAX_THREADS];
+	double t;
+	int i;
+
+	b->legacy = legacy;
+	b->start = 0;
+	for (i = 0; i < threads; ++i) {
+		pthread_create(&tid[i], NULL, lookup, b);
+	}
+	t = now();
+	b->start = 1;
+	for (i = 0; i < threads; ++i) {
+		pthread_join(tid[i], NULL);
+	}
+	t = now() - t;
+	return b->count * threads / t / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench b;
+	struct xu_actor *xa;
+	int i, n;
+
+	memset(&b, 0, sizeof b);
+	b.count = argc > 1 ? atol(argv[1]) : 1000000;
+	xu_envinit();
+	xu_kern_global_init(argc > 2 ? argv[2] : "./svc");
+	rwlock_init(&b.l.lock);
+	for (i = 0; i < ACTORS; ++i) {
+		if ((xa = xu_actor_new("logger", "")) == NULL) {
+			fprintf(stderr, "can't launch logger, check the module path\n");
+			return 1;
+		}
+		b.handle[i] = xu_actor_handle(xa);
+		b.l.handle[b.handle[i] & (ACTORS - 1)] = b.handle[i];
+	}
+
+	printf("%-10s %16s %16s\n", "threads", "rwlock Mref/s", "epoch Mref/s");
+	for (n = 1; n <= MAX_THREADS; n *= 2) {
+		double old = run(&b, 1, n);
+		double new = run(&b, 0, n);
+		printf("%-10d %16.2f %16.2f\n", n, old, new);
+	}
+	return 0;
+}
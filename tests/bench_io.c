@@ -0,0 +1,160 @@
+/*
+ * IO request channel benchmark.
+ *
+ * N threads call xu_io_write while the loop thread drains the requests,
+ * compared with the old channel: a request written to a pipe and read
+ * back with two read() calls.  The writes target no socket, only the
+ * hand-over to the IO thread is measured.
+ *
+ * usage: bench_io [writes per thread] [bytes per write]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include "uv.h"
+#include "xu_impl.h"
+#include "xu_kern.h"
+#include "xu_io.h"
+
+#define MAX_THREADS 8
+
+/* the old request, header and payload through a pipe */
+struct legacy_req {
+	uint32_t head;
+	uint32_t owner;
+	uint32_t fdesc;
+	size_t   len;
+	void    *data;
+	char     buffer[512 - sizeof (size_t) - sizeof (void *)];
+};
+
+struct bench {
+	int legacy;
+	long count;
+	int size;
+	int pfd[2];
+	uv_async_t stop;
+	volatile int start;
+};
+
+static void *writer(void *ud)
+{
+	struct bench *b = ud;
+	struct legacy_req req;
+	char data[512];
+	int hdr = offsetof(struct legacy_req, len);
+	long i;
+
+	memset(data, 'x', sizeof data);
+	while (!b->start)
+		sched_yield();
+	for (i = 0; i < b->count; ++i) {
+		if (b->legacy) {
+			req.head = sizeof req.len + sizeof req.data + b->size;
+			req.owner = 1;
+			req.fdesc = 1;
+			req.len = b->size;
+			req.data = req.buffer;
+			memcpy(req.buffer, data, b->size);
+			if (write(b->pfd[1], &req, hdr + req.head) < 0)
+				break;
+		} else {
+			xu_io_write(1, 1, data, b->size);
+		}
+	}
+	return NULL;
+}
+
+static void *reader(void *ud)
+{
+	struct bench *b = ud;
+	struct legacy_req req;
+	int hdr = offsetof(struct legacy_req, len);
+
+	while (read(b->pfd[0], &req, hdr) == hdr && req.head > 0) {
+		if (read(b->pfd[0], &req.len, req.head) < 0)
+			break;
+	}
+	return NULL;
+}
+
+static void on_stop(uv_async_t *as)
+{
+	uv_stop(as->loop);
+}
+
+static void *loop(void *ud)
+{
+	uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(struct bench *b, int legacy, int threads)
+{
+	pthread_t tid[MAX_THREADS], io;
+	uint32_t end = 0;
+	double t;
+	int i;
+
+	b->legacy = legacy;
+	b->start = 0;
+	pthread_create(&io, NULL, legacy ? reader : loop, b);
+	for (i = 0; i < threads; ++i) {
+		pthread_create(&tid[i], NULL, writer, b);
+	}
+	t = now();
+	b->start = 1;
+	for (i = 0; i < threads; ++i) {
+		pthread_join(tid[i], NULL);
+	}
+	/* behind every request, the loop runs the channel's async first */
+	if (legacy)
+		(void)!write(b->pfd[1], &end, sizeof end);
+	else
+		uv_async_send(&b->stop);
+	pthread_join(io, NULL);
+	t = now() - t;
+	return b->count * threads / t / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench b;
+	int n;
+
+	memset(&b, 0, sizeof b);
+	b.count = argc > 1 ? atol(argv[1]) : 1000000;
+	b.size = argc > 2 ? atoi(argv[2]) : 64;
+	if (b.size <= 0 || b.size > sizeof ((struct legacy_req *)0)->buffer) {
+		fprintf(stderr, "bytes per write: 1..%d\n", (int)sizeof ((struct legacy_req *)0)->buffer);
+		return 1;
+	}
+	xu_envinit();
+	xu_io_init();
+	uv_async_init(uv_default_loop(), &b.stop, on_stop);
+	if (pipe(b.pfd) < 0) {
+		perror("pipe");
+		return 1;
+	}
+
+	printf("%-10s %16s %16s\n", "threads", "pipe Mwrite/s", "async Mwrite/s");
+	for (n = 1; n <= MAX_THREADS; n *= 2) {
+		double old = run(&b, 1, n);
+		double new = run(&b, 0, n);
+		printf("%-10d %16.2f %16.2f\n", n, old, new);
+	}
+	return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Mailbox contention benchmark.
+ *
+ * N producer threads put messages into one queue while a single consumer
+ * drains it, compared with the old spinlock protected ring.
+ *
+ * usage: bench_mq [messages per producer]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "xu_impl.h"
+#include "xu_kern.h"
+
+#define MAX_PRODUCERS 8
+
+struct ring {
+	int cap;
+	int head;
+	int tail;
+	struct xu_msg *msgs;
+	struct spinlock lock;
+};
+
+static void ring_put(struct ring *q, struct xu_msg *msg)
+{
+	SPIN_LOCK(q);
+	q->msgs[q->tail] = *msg;
+	if (++q->tail >= q->cap) {
+		q->tail = 0;
+	}
+	if (q->head == q->tail) {
+		struct xu_msg *nq = xu_calloc(q->cap * 2, sizeof *nq);
+		int i;
+
+		for (i = 0; i < q->cap; ++i) {
+			nq[i] = q->msgs[(q->head + i) % q->cap];
+		}
+		q->head = 0;
+		q->tail = q->cap;
+		q->cap *= 2;
+		xu_free(q->msgs);
+		q->msgs = nq;
+	}
+	SPIN_UNLOCK(q);
+}
+
+static int ring_get(struct ring *q, struct xu_msg *msg)
+{
+	int ret = 1;
+
+	SPIN_LOCK(q);
+	if (q->head != q->tail) {
+		*msg = q->msgs[q->head++];
+		if (q->head >= q->cap) {
+			q->head = 0;
+		}
+		ret = 0;
+	}
+	SPIN_UNLOCK(q);
+	return ret;
+}
+
+struct bench {
+	int legacy;
+	int producers;
+	long count;
+	struct ring ring;
+	struct queue *q;
+	volatile int start;
+};
+
+static void *producer(void *ud)
+{
+	struct bench *b = ud;
+	struct xu_msg msg;
+	long i;
+
+	memset(&msg, 0, sizeof msg);
+	while (!b->start)
+		sched_yield();
+	for (i = 0; i < b->count; ++i) {
+		msg.source = (uint32_t)i;
+		if (b->legacy)
+			ring_put(&b->ring, &msg);
+		else
+			xu_queue_put(b->q, &msg);
+	}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(int legacy, int producers, long count)
+{
+	pthread_t pid[MAX_PRODUCERS];
+	struct bench b;
+	struct xu_msg msg;
+	long total = count * producers, got = 0;
+	double t;
+	int i;
+
+	memset(&b, 0, sizeof b);
+	b.legacy = legacy;
+	b.producers = producers;
+	b.count = count;
+	b.ring.cap = 64;
+	b.ring.msgs = xu_calloc(b.ring.cap, sizeof (struct xu_msg));
+	SPIN_INIT(&b.ring);
+	b.q = xu_queue_new(1);
+
+	for (i = 0; i < producers; ++i) {
+		pthread_create(&pid[i], NULL, producer, &b);
+	}
+	t = now();
+	b.start = 1;
+	while (got < total) {
+		if (legacy) {
+			if (ring_get(&b.ring, &msg) == 0)
+				++got;
+			else
+				sched_yield();
+		} else if (xu_queue_get(b.q, &msg) == 0) {
+			++got;
+		} else {
+			/* the queue went back to the global list, take it again */
+			while (xu_queue_pop() == NULL)
+				sched_yield();
+		}
+	}
+	t = now() - t;
+	for (i = 0; i < producers; ++i) {
+		pthread_join(pid[i], NULL);
+	}
+	xu_free(b.ring.msgs);
+	return total / t / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	long count = argc > 1 ? atol(argv[1]) : 1000000;
+	int n;
+
+	printf("%-10s %16s %16s\n", "producers", "spinlock Mmsg/s", "lockfree Mmsg/s");
+	for (n = 1; n <= MAX_PRODUCERS; n *= 2) {
+		double old = run(1, n, count);
+		double new = run(0, n, count);
+		printf("%-10d %16.2f %16.2f\n", n, old, new);
+	}
+	return 0;
+}
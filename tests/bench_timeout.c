@@ -0,0 +1,134 @@
+/*
+ * Timer arming benchmark.
+ *
+ * N threads arm and cancel timeouts for their own handle while a ticker
+ * thread advances the wheels every millisecond, with a single wheel and
+ * with the sharded ones.  Each configuration runs in a child process,
+ * the wheels are set up once per process.
+ *
+ * usage: bench_timeout [timeouts per thread] [module path]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "xu_impl.h"
+#include "xu_kern.h"
+
+#define MAX_THREADS 8
+
+struct bench {
+	long count;
+	volatile int start;
+	volatile int stop;
+};
+
+struct worker {
+	struct bench *b;
+	uint32_t handle;
+};
+
+static void *arm(void *ud)
+{
+	struct worker *w = ud;
+	long i;
+
+	while (!w->b->start)
+		sched_yield();
+	for (i = 0; i < w->b->count; ++i) {
+		xu_timeout(w->handle, 1000 + (int)(i & 1023), (int)i + 1);
+		xu_timeout_cancel(w->handle, (int)i + 1);
+	}
+	return NULL;
+}
+
+static void *ticker(void *ud)
+{
+	struct bench *b = ud;
+
+	while (!b->stop) {
+		xu_updatetime();
+		usleep(1000);
+	}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(struct bench *b, int threads)
+{
+	pthread_t tid[MAX_THREADS], tick;
+	struct worker w[MAX_THREADS];
+	double t;
+	int i;
+
+	b->start = 0;
+	b->stop = 0;
+	pthread_create(&tick, NULL, ticker, b);
+	for (i = 0; i < threads; ++i) {
+		w[i].b = b;
+		/* consecutive handles, as actors started one after another */
+		w[i].handle = 0x100 + i;
+		pthread_create(&tid[i], NULL, arm, &w[i]);
+	}
+	t = now();
+	b->start = 1;
+	for (i = 0; i < threads; ++i) {
+		pthread_join(tid[i], NULL);
+	}
+	t = now() - t;
+	b->stop = 1;
+	pthread_join(tick, NULL);
+	return b->count * threads / t / 1e6;
+}
+
+static void child(const char *shards, long count, const char *path)
+{
+	struct xu_timer_stat st;
+	struct bench b;
+	int n;
+
+	xu_envinit();
+	xu_setenv("timer_shards", shards);
+	xu_timer_init();
+	xu_kern_global_init(path);
+	memset(&b, 0, sizeof b);
+	b.count = count;
+	for (n = 1; n <= MAX_THREADS; n *= 2) {
+		printf("%-10s %-10d %14.2f\n", shards, n, run(&b, n));
+		fflush(stdout);
+	}
+	xu_timer_stat(&st);
+	if (st.live)
+		printf("%u timeouts left\n", st.live);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *shards[] = {"1", "8"};
+	long count = argc > 1 ? atol(argv[1]) : 1000000;
+	const char *path = argc > 2 ? argv[2] : "./svc";
+	int i, status;
+
+	printf("%-10s %-10s %14s\n", "shards", "threads", "Mtimeout/s");
+	fflush(stdout);
+	for (i = 0; i < sizeof shards / sizeof shards[0]; ++i) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			child(shards[i], count, path);
+			_exit(0);
+		}
+		waitpid(pid, &status, 0);
+	}
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Timer catch-up benchmark.
+ *
+ * Arms timeouts spread over the stall window, blocks the timer thread
+ * for the stall, then measures how long xu_updatetime takes to replay
+ * the missed ticks and deliver the expired timeouts.  A far timeout
+ * stays pending so the wheels are never empty.
+ *
+ * usage: bench_timer [timeouts] [module path] [tick us]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "xu_impl.h"
+#include "xu_kern.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int stalls[] = {10, 50, 200, 1000};
+	int count = argc > 1 ? atoi(argv[1]) : 100000;
+	struct xu_timer_stat st;
+	struct xu_actor *xa;
+	uint32_t h;
+	double t;
+	int i, j, session = 0;
+
+	xu_envinit();
+	if (argc > 3)
+		xu_setenv("timer_tick", argv[3]);
+	xu_timer_init();
+	xu_kern_global_init(argc > 2 ? argv[2] : "./svc");
+	if ((xa = xu_actor_new("logger", "")) == NULL) {
+		fprintf(stderr, "can't launch logger, check the module path\n");
+		return 1;
+	}
+	/* the timeouts pile up in its mailbox, nobody dispatches it */
+	h = xu_actor_handle(xa);
+	xu_updatetime();
+	xu_timeout(h, 3600 * 1000, ++session);
+
+	printf("%-10s %10s %12s %14s\n", "stall ms", "timeouts", "catch-up us", "ns per ms");
+	for (i = 0; i < sizeof stalls / sizeof stalls[0]; ++i) {
+		for (j = 0; j < count; ++j) {
+			xu_timeout(h, 1 + j % stalls[i], ++session);
+		}
+		usleep(stalls[i] * 1000);
+		t = now();
+		xu_updatetime();
+		t = now() - t;
+		xu_timer_stat(&st);
+		printf("%-10d %10d %12.1f %14.1f%s\n", stalls[i], count, t * 1e6,
+			t * 1e9 / stalls[i], st.live > 1 ? "  (timeouts left)" : "");
+	}
+	return 0;
+}
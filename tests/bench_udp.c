@@ -0,0 +1,125 @@
+/*
+ * Batched UDP benchmark.
+ *
+ * Datagrams over loopback, a round of `batch' sent and read back, one
+ * syscall per datagram (sendto / recvfrom) against one per round
+ * (sendmmsg / recvmmsg), the way a batched socket of the IO thread does.
+ *
+ * usage: bench_udp [datagrams] [bytes per datagram]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_BATCH 32
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(int tx, int rx, struct sockaddr_in *to, long count, int size, int batch)
+{
+	struct mmsghdr msgs[MAX_BATCH];
+	struct iovec iov[MAX_BATCH];
+	char buf[MAX_BATCH][2048];
+	long done = 0;
+	double t;
+	int i, n;
+
+	memset(msgs, 0, sizeof msgs);
+	for (i = 0; i < MAX_BATCH; ++i) {
+		memset(buf[i], 'x', size);
+		iov[i].iov_base = buf[i];
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	t = now();
+	while (done < count) {
+		/* send a round */
+		if (batch > 1) {
+			for (i = 0; i < batch; ++i) {
+				iov[i].iov_len = size;
+				msgs[i].msg_hdr.msg_name = to;
+				msgs[i].msg_hdr.msg_namelen = sizeof *to;
+			}
+			for (i = 0; i < batch; i += n) {
+				if ((n = sendmmsg(tx, msgs + i, batch - i, 0)) <= 0) {
+					perror("sendmmsg");
+					exit(1);
+				}
+			}
+		} else {
+			if (sendto(tx, buf[0], size, 0, (struct sockaddr *)to, sizeof *to) != size) {
+				perror("sendto");
+				exit(1);
+			}
+		}
+		/* and read it back */
+		if (batch > 1) {
+			for (i = 0; i < batch; ++i) {
+				iov[i].iov_len = sizeof buf[i];
+				msgs[i].msg_hdr.msg_name = NULL;
+				msgs[i].msg_hdr.msg_namelen = 0;
+			}
+			for (i = 0; i < batch; i += n) {
+				if ((n = recvmmsg(rx, msgs + i, batch - i, 0, NULL)) <= 0) {
+					perror("recvmmsg");
+					exit(1);
+				}
+			}
+		} else {
+			if (recvfrom(rx, buf[0], sizeof buf[0], 0, NULL, NULL) != size) {
+				perror("recvfrom");
+				exit(1);
+			}
+		}
+		done += batch;
+	}
+	t = now() - t;
+	return done / t / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof addr;
+	long count;
+	int size, tx, rx, b;
+
+	count = argc > 1 ? atol(argv[1]) : 1000000;
+	size = argc > 2 ? atoi(argv[2]) : 64;
+	if (size <= 0 || size > 1472) {
+		fprintf(stderr, "bytes per datagram: 1..1472\n");
+		return 1;
+	}
+
+	tx = socket(AF_INET, SOCK_DGRAM, 0);
+	rx = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (tx < 0 || rx < 0 || bind(rx, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+			getsockname(rx, (struct sockaddr *)&addr, &len) < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	printf("%-10s %16s\n", "batch", "Mdgram/s");
+	for (b = 1; b <= MAX_BATCH; b *= 2) {
+		printf("%-10d %16.3f\n", b, run(tx, rx, &addr, count, size, b));
+	}
+	close(tx);
+	close(rx);
+	return 0;
+}